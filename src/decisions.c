@@ -0,0 +1,137 @@
+/* 2014, Copyright Intel & Jose Bollo <jose.bollo@open.eurogiciel.org>, license MIT */
+
+#include <stdlib.h>
+#include <errno.h>
+#include <assert.h>
+
+#include "decisions.h"
+
+#define DECISIONS_HASH_SIZE	1024	/* count of buckets, MUST be a power of 2 */
+#define DECISIONS_MAX		8192	/* maximum count of recorded decisions */
+
+/*
+a decision is recorded for a session, an executable (its device and its
+inode) and a key. the decisions of the session DECISIONS_APPLICATION are
+applying to every process of the executable. the oldest decisions are
+forgotten first when the maximum count is reached.
+*/
+struct decision {
+	struct decision *hnext;
+	struct decision *next;
+	struct decision *prev;
+	uint64_t session;
+	dev_t dev;
+	ino_t ino;
+	int kid;
+	char value;
+};
+
+static struct decision *buckets[DECISIONS_HASH_SIZE];
+static struct decision *oldest = 0;
+static struct decision *newest = 0;
+static struct decision *unused = 0;
+static int count = 0;
+
+/* compute the bucket of the decision */
+static int hash(uint64_t session, dev_t dev, ino_t ino, int kid)
+{
+	uint64_t h;
+
+	h = session * 0x9e3779b97f4a7c15ULL;
+	h ^= (uint64_t)dev * 0xc2b2ae3d27d4eb4fULL;
+	h ^= (uint64_t)ino * 0x165667b19e3779f9ULL;
+	h ^= (uint64_t)(unsigned)kid * 0x27d4eb2f165667c5ULL;
+	h ^= h >> 29;
+	return (int)(h & (DECISIONS_HASH_SIZE - 1));
+}
+
+/* search the decision and returns the address of the pointer to it */
+static struct decision **search(uint64_t session, dev_t dev, ino_t ino, int kid)
+{
+	struct decision **prv, *d;
+
+	prv = &buckets[hash(session, dev, ino, kid)];
+	d = *prv;
+	while (d && (d->kid != kid || d->ino != ino || d->dev != dev || d->session != session)) {
+		prv = &d->hnext;
+		d = *prv;
+	}
+	return prv;
+}
+
+/* removes the decision pointed by 'prv' */
+static void remove_decision(struct decision **prv)
+{
+	struct decision *d;
+
+	d = *prv;
+	assert(d);
+	*prv = d->hnext;
+	if (d->next)
+		d->next->prev = d->prev;
+	else
+		newest = d->prev;
+	if (d->prev)
+		d->prev->next = d->next;
+	else
+		oldest = d->next;
+	d->hnext = unused;
+	unused = d;
+	count--;
+}
+
+char decisions_get(uint64_t session, dev_t dev, ino_t ino, int kid)
+{
+	struct decision *d;
+
+	d = *search(session, dev, ino, kid);
+	return d ? d->value : 0;
+}
+
+int decisions_set(uint64_t session, dev_t dev, ino_t ino, int kid, char value)
+{
+	struct decision **prv, *d;
+
+	assert(value);
+
+	prv = search(session, dev, ino, kid);
+	d = *prv;
+	if (d) {
+		d->value = value;
+		return 0;
+	}
+
+	/* forget the oldest decision if needed */
+	if (count >= DECISIONS_MAX) {
+		d = oldest;
+		remove_decision(search(d->session, d->dev, d->ino, d->kid));
+		prv = search(session, dev, ino, kid);
+	}
+
+	/* get a new decision */
+	d = unused;
+	if (d)
+		unused = d->hnext;
+	else {
+		d = malloc(sizeof * d);
+		if (!d)
+			return -ENOMEM;
+	}
+
+	d->session = session;
+	d->dev = dev;
+	d->ino = ino;
+	d->kid = kid;
+	d->value = value;
+	d->hnext = 0;
+	*prv = d;
+	d->next = 0;
+	d->prev = newest;
+	if (newest)
+		newest->next = d;
+	else
+		oldest = d;
+	newest = d;
+	count++;
+	return 0;
+}
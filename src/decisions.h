@@ -0,0 +1,9 @@
+/* 2014, Copyright Intel & Jose Bollo <jose.bollo@open.eurogiciel.org>, license MIT */
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#define DECISIONS_APPLICATION	0	/* session of the decisions for all the sessions */
+
+char decisions_get(uint64_t session, dev_t dev, ino_t ino, int kid);
+int decisions_set(uint64_t session, dev_t dev, ino_t ino, int kid, char value);
@@ -126,8 +126,8 @@ static int get_tag(const char *tag, int create)
 	/* insertion now */
 	k = tag_count++;
 	tag_strings[k] = s;
-	for (i = k ; i >= u ; i--)
-		tag_indexes[i + 1] = tag_indexes[i];
+	for (i = k ; i > u ; i--)
+		tag_indexes[i] = tag_indexes[i - 1];
 	tag_indexes[u] = k;
 	return k;
 }
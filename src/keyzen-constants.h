@@ -4,10 +4,24 @@
 #define KEYZEN_CONSTANTS_H
 
 #define KEYZEN_FS_KEY      "keyzen-fs"
+#define KEYZEN_MOUNTPOINT  "/run/keyzen"
+#define KEYZEN_MOUNTPOINT_ENV "KEYZEN_MOUNTPOINT"
 #define KEYZEN_SELF_NAME   "self"
 #define KEYZEN_DIAL_NAME   "dial"
+#define KEYZEN_EVENTS_NAME "events"
+#define KEYZEN_QUERY_NAME  ".query"
+#define KEYZEN_UPDATE_NAME ".update"
+#define KEYZEN_LIST_NAME   ".list"
+#define KEYZEN_SNAPSHOT    "/run/keyzen.snapshot"
 #define KEYZEN_XATTR_KEY   "security.keyzen"
 #define KEYZEN_ADMIN_KEY   "keyzen.admin"
+#define KEYZEN_QUERY_MAX   1024
+
+#define KEYZEN_XATTR_TIMEDOUT  "user.keyzen.timedout"
+#define KEYZEN_XATTR_ABANDONED "user.keyzen.abandoned"
+#define KEYZEN_XATTR_GENERATION "user.keyzen.generation"
+#define KEYZEN_XATTR_MODE      "user.keyzen.mode"
+#define KEYZEN_XATTR_SNAPSHOT  "user.keyzen.snapshot"
 
 #endif
 
@@ -0,0 +1,169 @@
+/* 2014, Copyright Intel & Jose Bollo <jose.bollo@open.eurogiciel.org>, license MIT */
+
+#ifndef KEYZEN_DIAL_H
+#define KEYZEN_DIAL_H
+
+#include <stdint.h>
+
+/*
+ * Shared memory ring transport of the dial protocol.
+ *
+ * The agent creates a memory file (memfd) holding a header
+ * followed by 'request_count' request records and by
+ * 'answer_count' answer records, and two eventfds. It then
+ * writes on dial the control line:
+ *
+ *    "ring" sp memfd sp evreq sp evans lf
+ *
+ * where memfd, evreq and evans are the numbers of the
+ * file descriptors of the agent. The memfd must be created
+ * with MFD_ALLOW_SEALING and sealed with F_SEAL_SHRINK.
+ *
+ * keyzen-fs produces the requests and signals 'evreq'.
+ * The agent produces the answers and signals 'evans',
+ * what also tells keyzen-fs that requests were consumed.
+ *
+ * The heads and the tails are free running counters, the
+ * record of a counter is at the index (counter & (count - 1)).
+ * Only the producer writes the head and only the consumer
+ * writes the tail.
+ *
+ * Requests of keys longer than KEYZEN_RING_KEY_MAX are
+ * still delivered by reading dial.
+ */
+
+#define KEYZEN_RING_MAGIC    0x4b5a5247  /* "KZRG" */
+#define KEYZEN_RING_VERSION  1
+#define KEYZEN_RING_KEY_MAX  243
+
+struct keyzen_ring_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t request_count;   /* count of request records, a power of 2 */
+	uint32_t answer_count;    /* count of answer records, a power of 2 */
+	uint32_t request_head;    /* written by keyzen-fs */
+	uint32_t request_tail;    /* written by the agent */
+	uint32_t answer_head;     /* written by the agent */
+	uint32_t answer_tail;     /* written by keyzen-fs */
+	uint32_t reserved[8];
+};
+
+struct keyzen_ring_request {
+	uint32_t seq;
+	uint32_t pid;
+	uint32_t kid;
+	char type;                /* '!', '+', '*', '=' or '-' */
+	char key[KEYZEN_RING_KEY_MAX];  /* zero terminated */
+};
+
+struct keyzen_ring_answer {
+	uint32_t seq;
+	char grant;               /* 'y' or 'n' */
+	char type;                /* '!', '+', '*', '=' or '-' */
+	uint16_t reserved;
+};
+
+#define KEYZEN_RING_SIZE(nreq,nans) \
+		(sizeof(struct keyzen_ring_header) \
+		 + (size_t)(nreq) * sizeof(struct keyzen_ring_request) \
+		 + (size_t)(nans) * sizeof(struct keyzen_ring_answer))
+
+#define KEYZEN_RING_REQUESTS(header) \
+		((struct keyzen_ring_request*)((struct keyzen_ring_header*)(header) + 1))
+
+#define KEYZEN_RING_ANSWERS(header) \
+		((struct keyzen_ring_answer*)(KEYZEN_RING_REQUESTS(header) \
+		 + ((struct keyzen_ring_header*)(header))->request_count))
+
+/*
+ * Binary framing of the dial protocol.
+ *
+ * The agent switches dial from the text protocol to the
+ * binary one by writing the control line:
+ *
+ *    "binary" sp version lf
+ *
+ * After it, reading dial delivers request records and
+ * the agent writes answer records. A record starts with
+ * the head 'keyzen_record' whose 'length' counts the whole
+ * record, head included, and is a multiple of 4. Integers
+ * are in the byte order of the host.
+ *
+ * A request record is followed by the 'keylen' bytes of the
+ * key, not zero terminated, and then by optional fields.
+ * Each field is a 'keyzen_field' followed by its 'length'
+ * bytes of data, padded to a multiple of 4. Unknown fields
+ * and unknown kinds of record must be skipped.
+ *
+ * A control record carries a control line, without its
+ * lf, padded with zeros.
+ */
+
+#define KEYZEN_BINARY_VERSION     1
+
+#define KEYZEN_RECORD_REQUEST     1
+#define KEYZEN_RECORD_ANSWER      2
+#define KEYZEN_RECORD_CONTROL     3
+
+#define KEYZEN_RECORD_ALIGN(x)    (((x) + 3) & ~(size_t)3)
+
+struct keyzen_record {
+	uint32_t length;
+	uint16_t kind;
+	uint16_t flags;
+};
+
+struct keyzen_request_record {
+	struct keyzen_record head;  /* kind is KEYZEN_RECORD_REQUEST */
+	uint32_t seq;
+	uint32_t pid;
+	uint32_t kid;
+	char type;                  /* '!', '+', '*', '=' or '-' */
+	char reserved;
+	uint16_t keylen;
+};
+
+struct keyzen_answer_record {
+	struct keyzen_record head;  /* kind is KEYZEN_RECORD_ANSWER */
+	uint32_t seq;
+	char grant;                 /* 'y' or 'n' */
+	char type;                  /* '!', '+', '*', '=' or '-' */
+	uint16_t reserved;
+};
+
+struct keyzen_field {
+	uint16_t tag;
+	uint16_t length;
+};
+
+/*
+ * Context of the requests.
+ *
+ * The agent asks for the context of the requesting processes
+ * by writing on dial the control line:
+ *
+ *    "context" sp version lf
+ *
+ * where version is KEYZEN_CONTEXT_VERSION or 0 to stop it.
+ * The text requests are then:
+ *
+ *    seq sp pid sp uid sp session sp exe sp cgroup sp type key lf
+ *
+ * where exe and cgroup are '-' when unknown and have their
+ * bytes '%', space, controls and delete escaped as '%' followed
+ * by 2 lowercase hexadecimal digits. The binary requests are
+ * followed by the fields below. The session is the one used for
+ * the decisions of mode '+': the audit session plus one or, when
+ * not set, the session id of the process plus 2^32.
+ *
+ * The context is not given through the ring.
+ */
+
+#define KEYZEN_CONTEXT_VERSION    1
+
+#define KEYZEN_FIELD_UID          1   /* uint32_t */
+#define KEYZEN_FIELD_SESSION      2   /* uint64_t */
+#define KEYZEN_FIELD_EXE          3   /* path of the executable, not zero terminated */
+#define KEYZEN_FIELD_CGROUP       4   /* path of the cgroup, not zero terminated */
+
+#endif
@@ -1,9 +1,11 @@
 /* 2014, Copyright Intel & Jose Bollo <jose.bollo@open.eurogiciel.org>, license MIT */
 
+#define _GNU_SOURCE
 #define FUSE_USE_VERSION 26
 
 #include <fuse_lowlevel.h>
 #include <stdio.h>
+#include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
@@ -12,12 +14,27 @@
 #include <assert.h>
 #include <time.h>
 #include <limits.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
 #include <attr/xattr.h>
+#include <linux/netlink.h>
+#include <linux/connector.h>
+#include <linux/cn_proc.h>
 
 #include "procs.h"
 #include "keyset.h"
+#include "wheel.h"
+#include "decisions.h"
 
 #include "keyzen-constants.h"
+#include "keyzen-dial.h"
+#include "keyzen-snapshot.h"
 
 #include "itoa.c"
 
@@ -51,6 +68,7 @@
 #define MKINO_TYPE(type)		MKFIELD(type,2,28)
 
 #define INOTYP_BIN				0
+#define INOTYP_CTL				1
 #define INOTYP_DIR				2
 #define INOTYP_KEY				3
 
@@ -59,15 +77,23 @@
 #define INODE_ROOT				MK_INO(INOTYP_BIN,   0, 1)
 #define INODE_SELF				MK_INO(INOTYP_BIN,   0, 2)
 #define INODE_DIAL				MK_INO(INOTYP_BIN,   0, 3)
+#define INODE_EVENTS			MK_INO(INOTYP_BIN,   0, 4)
 #define MK_INODE_DIR(pid)		MK_INO(INOTYP_DIR, pid, 0)
 #define MK_INODE_KEY(pid,kid)	MK_INO(INOTYP_KEY, pid, kid)
+#define MK_INODE_CTL(pid,ctl)	MK_INO(INOTYP_CTL, pid, ctl)
 
 #define INODE_KEY(ino)			FIELD(ino,13,0)
+#define INODE_CTL(ino)			FIELD(ino,13,0)
 #define INODE_PID(ino)			FIELD(ino,15,13)
 #define INODE_TYPE(ino)			FIELD(ino,2,28)
 
 #define IS_INODE_DIR(ino)		(INODE_TYPE(ino) == INOTYP_DIR)
 #define IS_INODE_KEY(ino)		(INODE_TYPE(ino) == INOTYP_KEY)
+#define IS_INODE_CTL(ino)		(INODE_TYPE(ino) == INOTYP_CTL)
+
+#define CTL_QUERY				1	/* the control file .query of a process */
+#define CTL_UPDATE				2	/* the control file .update of a process */
+#define CTL_LIST				3	/* the control file .list of a process */
 
 time_t  root_time;
 
@@ -77,6 +103,717 @@ time_t  root_time;
 #define CHAR_PERMIT		'='
 #define CHAR_DENY		'-'
 
+/*====================================================*/
+/*===================== EVENTS =======================*/
+/*====================================================*/
+
+/*
+the file events delivers to its readers the lines:
+
+   "set" sp pid sp type key lf          a key is set
+   "drop" sp pid sp key lf              a key is dropped
+   "verdict" sp pid sp grant type key lf  an agent decided
+   "exit" sp pid lf                     a process exited
+   "lost" sp count lf                   count lines were lost
+
+each reader has its own ring of EVENTS_RING_SIZE bytes. the
+lines not fitting in the ring are lost and counted, the count
+is given by a line "lost" as soon as there is room for it.
+*/
+
+#define EVENTS_RING_SIZE	65536	/* size of the ring of a reader, MUST be a power of 2 */
+#define EVENTS_LINE_MAX		4096	/* maximum length of a line */
+
+struct events_reader {
+	struct events_reader *next;
+	struct events_reader *prev;
+	char *ring;
+	size_t head;						/* free running count of bytes written */
+	size_t tail;						/* free running count of bytes read */
+	unsigned long lost;					/* count of lines lost not yet reported */
+	fuse_req_t read_req;				/* blocked read or null */
+	size_t read_size;
+	struct fuse_pollhandle *poll_handle;
+	int nonblock;
+};
+
+static struct events_reader *events_first = 0;
+
+/* put the line in the ring of reader if it fits */
+static int events_put(struct events_reader *reader, const char *line, size_t length)
+{
+	size_t pos, n;
+
+	if (EVENTS_RING_SIZE - (reader->head - reader->tail) < length)
+		return 0;
+	pos = reader->head & (EVENTS_RING_SIZE - 1);
+	n = EVENTS_RING_SIZE - pos;
+	if (n > length)
+		n = length;
+	memcpy(reader->ring + pos, line, n);
+	memcpy(reader->ring, line + n, length - n);
+	reader->head += length;
+	return 1;
+}
+
+/* report the lost lines if possible */
+static void events_put_lost(struct events_reader *reader)
+{
+	char line[40];
+
+	if (reader->lost && events_put(reader, line, (size_t)sprintf(line, "lost %lu\n", reader->lost)))
+		reader->lost = 0;
+}
+
+/* reply to the read the available bytes */
+static void events_send(struct events_reader *reader, fuse_req_t req, size_t size)
+{
+	size_t pos, n;
+
+	n = reader->head - reader->tail;
+	if (size > n)
+		size = n;
+	pos = reader->tail & (EVENTS_RING_SIZE - 1);
+	n = EVENTS_RING_SIZE - pos;
+	if (n >= size)
+		fuse_reply_buf(req, reader->ring + pos, size);
+	else {
+		/* the bytes are wrapping */
+		struct iovec iov[2];
+		iov[0].iov_base = reader->ring + pos;
+		iov[0].iov_len = n;
+		iov[1].iov_base = reader->ring;
+		iov[1].iov_len = size - n;
+		fuse_reply_iov(req, iov, 2);
+	}
+	reader->tail += size;
+	events_put_lost(reader);
+}
+
+/* give the line to all the readers */
+static void events_emit(const char *line, size_t length)
+{
+	struct events_reader *reader;
+
+	for (reader = events_first ; reader ; reader = reader->next) {
+		events_put_lost(reader);
+		if (reader->lost || !events_put(reader, line, length)) {
+			reader->lost++;
+			continue;
+		}
+		if (reader->read_req) {
+			events_send(reader, reader->read_req, reader->read_size);
+			reader->read_req = 0;
+		}
+		if (reader->poll_handle) {
+			fuse_lowlevel_notify_poll(reader->poll_handle);
+			fuse_pollhandle_destroy(reader->poll_handle);
+			reader->poll_handle = 0;
+		}
+	}
+}
+
+/* emit the event of the format */
+static void events_printf(const char *fmt, ...)
+{
+	char line[EVENTS_LINE_MAX];
+	va_list ap;
+	int n;
+
+	if (!events_first)
+		return;
+
+	va_start(ap, fmt);
+	n = vsnprintf(line, sizeof line, fmt, ap);
+	va_end(ap);
+	if (n > 0 && n < (int)sizeof line)
+		events_emit(line, (size_t)n);
+}
+
+static struct events_reader *events_open(int nonblock)
+{
+	struct events_reader *reader;
+
+	reader = malloc(sizeof * reader);
+	if (reader) {
+		reader->ring = malloc(EVENTS_RING_SIZE);
+		if (!reader->ring) {
+			free(reader);
+			return 0;
+		}
+		reader->head = reader->tail = 0;
+		reader->lost = 0;
+		reader->read_req = 0;
+		reader->poll_handle = 0;
+		reader->nonblock = nonblock;
+		reader->prev = 0;
+		reader->next = events_first;
+		if (events_first)
+			events_first->prev = reader;
+		events_first = reader;
+	}
+	return reader;
+}
+
+static void events_read(struct events_reader *reader, fuse_req_t req, size_t size)
+{
+	if (reader->head != reader->tail)
+		events_send(reader, req, size);
+	else if (reader->nonblock)
+		fuse_reply_err(req, EAGAIN);
+	else if (reader->read_req)
+		fuse_reply_err(req, EBUSY);
+	else {
+		reader->read_req = req;
+		reader->read_size = size;
+	}
+}
+
+static void events_poll(struct events_reader *reader, fuse_req_t req, struct fuse_pollhandle *ph)
+{
+	if (ph) {
+		if (reader->poll_handle)
+			fuse_pollhandle_destroy(reader->poll_handle);
+		reader->poll_handle = ph;
+	}
+	fuse_reply_poll(req, reader->head != reader->tail ? POLLIN | POLLRDNORM : 0);
+}
+
+static void events_release(struct events_reader *reader)
+{
+	if (reader->prev)
+		reader->prev->next = reader->next;
+	else
+		events_first = reader->next;
+	if (reader->next)
+		reader->next->prev = reader->prev;
+	if (reader->read_req)
+		fuse_reply_err(reader->read_req, EBADF);
+	if (reader->poll_handle)
+		fuse_pollhandle_destroy(reader->poll_handle);
+	free(reader->ring);
+	free(reader);
+}
+
+/*====================================================*/
+/*===================== SNAPSHOT =====================*/
+/*====================================================*/
+
+/*
+the snapshot of the keys of the processes is published in shared
+memory for the clients (see keyzen-snapshot.h). it is updated at each
+change, under the lock. the rows of the processes are kept in the
+table 'snapshot_rows' whose free entries are linked through 'keyset'.
+when the capacities are exceeded, the snapshot is built again from
+the keysets with larger capacities. the exits of the processes are
+received from the process connector on 'snapshot_exits' for dropping
+their rows at once.
+*/
+
+#define SNAPSHOT_ALIGN(x)	(((x) + 15) & ~(uint32_t)15)
+
+struct snapshot_row {
+	int pid;		/* 0 when free */
+	int keyset;		/* index of the next free row when free */
+	uint64_t start;		/* start time of the process */
+};
+
+static const char *snapshot_path = KEYZEN_SNAPSHOT;
+static int snapshot_fd = -1;
+static struct keyzen_snapshot_header *snapshot_header = 0;
+static off_t snapshot_length = 0;
+static struct snapshot_row *snapshot_rows = 0;
+static int snapshot_row_count = 0;
+static int snapshot_row_free = -1;
+static uint32_t snapshot_names_alloc = 0;
+static uint32_t snapshot_names_used = 0;
+static int snapshot_exits = -1;
+
+#define SNAPSHOT_PIDS(h)	((uint32_t*)((char*)(h) + (h)->pids_offset))
+#define SNAPSHOT_STARTS(h)	((uint64_t*)((char*)(h) + (h)->starts_offset))
+#define SNAPSHOT_ROW(h,r)	((char*)(h) + (h)->rows_offset + (size_t)(r) * (h)->row_size)
+#define SNAPSHOT_KEYS(h)	((struct keyzen_snapshot_key*)((char*)(h) + (h)->keys_offset))
+#define SNAPSHOT_NAMES(h)	((char*)(h) + (h)->names_offset)
+
+static int snapshot_is_on()
+{
+	return snapshot_header && snapshot_header->state == KEYZEN_SNAPSHOT_ALIVE;
+}
+
+/* seqlock of the writer */
+static void snapshot_begin()
+{
+	__atomic_store_n(&snapshot_header->seq, snapshot_header->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void snapshot_end()
+{
+	__atomic_store_n(&snapshot_header->seq, snapshot_header->seq + 1, __ATOMIC_RELEASE);
+}
+
+/* get the start time of the process 'pid' or 0 when unknown */
+static uint64_t snapshot_start_of(int pid)
+{
+	char buffer[1024], *p;
+	uint64_t result;
+	ssize_t length;
+	int fd, i;
+
+	snprintf(buffer, sizeof buffer, "/proc/%d/stat", pid);
+	fd = open(buffer, O_RDONLY|O_CLOEXEC);
+	if (fd < 0)
+		return 0;
+	length = read(fd, buffer, sizeof buffer - 1);
+	close(fd);
+	if (length <= 0)
+		return 0;
+	buffer[length] = 0;
+
+	/* the state follows the name, the start is the 20th field after it */
+	p = strrchr(buffer, ')');
+	if (!p || p[1] != ' ' || p[2] == 'Z' || p[2] == 'X')
+		return 0;
+	for (i = 0 ; p && i < 20 ; i++)
+		p = strchr(p + 1, ' ');
+	if (!p)
+		return 0;
+	result = strtoull(p + 1, &p, 10);
+	return *p == ' ' ? result : 0;
+}
+
+static void snapshot_set_row(const char *key, int kid, char type, void *extra)
+{
+	((char*)extra)[kid] = type;
+}
+
+static int snapshot_compare_kids(const void *a, const void *b)
+{
+	return strcmp(keyset_key(*(const int*)a), keyset_key(*(const int*)b));
+}
+
+/* compare 'name' of 'length' to the name of the key 'key' */
+static int snapshot_compare_key(const char *name, uint32_t length, struct keyzen_snapshot_key *key)
+{
+	int d;
+
+	d = memcmp(name, SNAPSHOT_NAMES(snapshot_header) + key->offset, length < key->length ? length : key->length);
+	return d ? d : (length > key->length) - (length < key->length);
+}
+
+/* build the snapshot again from the keysets */
+static int snapshot_build()
+{
+	struct keyzen_snapshot_header *h = snapshot_header;
+	struct snapshot_row *rows;
+	struct keyzen_snapshot_key *keys;
+	uint32_t *pids, row_size, size, names, starts;
+	int i, n, kid, kcount, rcount, *kids;
+	char *row;
+
+	/* the counts */
+	for (kcount = 0 ; keyset_is_valid_keyid(kcount) ; kcount++);
+	for (i = n = 0 ; i < snapshot_row_count ; i++)
+		if (snapshot_rows[i].pid)
+			n++;
+	names = 0;
+	for (kid = 0 ; kid < kcount ; kid++)
+		names += (uint32_t)strlen(keyset_key(kid));
+
+	/* the capacities */
+	rcount = n + n / 2 + 16;
+	row_size = SNAPSHOT_ALIGN((uint32_t)(kcount + kcount / 2 + 16));
+	snapshot_names_alloc = SNAPSHOT_ALIGN(names + names / 2 + 256);
+	starts = (uint32_t)sizeof * h + KEYZEN_SNAPSHOT_PIDS * (uint32_t)sizeof * pids;
+	if ((uint64_t)starts + (uint64_t)rcount * (sizeof(uint64_t) + row_size)
+			+ (uint64_t)row_size * sizeof * keys + snapshot_names_alloc > KEYZEN_SNAPSHOT_MAX)
+		goto overflow;
+	size = starts + (uint32_t)rcount * ((uint32_t)sizeof(uint64_t) + row_size)
+			+ row_size * (uint32_t)sizeof * keys + snapshot_names_alloc;
+	if (size > snapshot_length) {
+		if (ftruncate(snapshot_fd, size) < 0)
+			goto overflow;
+		snapshot_length = size;
+	}
+
+	/* the rows, compacted */
+	rows = malloc((size_t)rcount * sizeof * rows);
+	kids = malloc((size_t)(kcount + 1) * sizeof * kids);
+	if (!rows || !kids) {
+		free(rows);
+		free(kids);
+		goto overflow;
+	}
+	for (i = n = 0 ; i < snapshot_row_count ; i++)
+		if (snapshot_rows[i].pid)
+			rows[n++] = snapshot_rows[i];
+	free(snapshot_rows);
+	snapshot_rows = rows;
+	snapshot_row_count = rcount;
+	snapshot_row_free = -1;
+	for (i = rcount ; i > n ; ) {
+		rows[--i].pid = 0;
+		rows[i].keyset = snapshot_row_free;
+		snapshot_row_free = i;
+	}
+
+	/* the keys sorted on their names */
+	for (kid = 0 ; kid < kcount ; kid++)
+		kids[kid] = kid;
+	qsort(kids, (size_t)kcount, sizeof * kids, snapshot_compare_kids);
+
+	snapshot_begin();
+	h->pid_count = KEYZEN_SNAPSHOT_PIDS;
+	h->pids_offset = (uint32_t)sizeof * h;
+	h->row_size = row_size;
+	h->starts_offset = starts;
+	h->rows_offset = starts + (uint32_t)rcount * (uint32_t)sizeof(uint64_t);
+	h->keys_offset = h->rows_offset + (uint32_t)rcount * row_size;
+	h->names_offset = h->keys_offset + row_size * (uint32_t)sizeof * keys;
+	h->size = size;
+
+	pids = SNAPSHOT_PIDS(h);
+	memset(pids, 0, KEYZEN_SNAPSHOT_PIDS * sizeof * pids);
+	for (i = 0 ; i < n ; i++) {
+		row = SNAPSHOT_ROW(h, i);
+		memset(row, 0, row_size);
+		keyset_for_all_not_null(rows[i].keyset, snapshot_set_row, row);
+		SNAPSHOT_STARTS(h)[i] = rows[i].start;
+		pids[rows[i].pid] = (uint32_t)i + 1;
+	}
+
+	keys = SNAPSHOT_KEYS(h);
+	snapshot_names_used = 0;
+	for (i = 0 ; i < kcount ; i++) {
+		keys[i].kid = (uint32_t)kids[i];
+		keys[i].offset = snapshot_names_used;
+		keys[i].length = (uint32_t)strlen(keyset_key(kids[i]));
+		memcpy(SNAPSHOT_NAMES(h) + snapshot_names_used, keyset_key(kids[i]), keys[i].length);
+		snapshot_names_used += keys[i].length;
+	}
+	h->key_count = (uint32_t)kcount;
+	snapshot_end();
+
+	free(kids);
+	return 0;
+
+overflow:
+	snapshot_begin();
+	h->state = KEYZEN_SNAPSHOT_OVERFLOW;
+	snapshot_end();
+	fprintf(stderr, "keyzen-fs: the snapshot is no more published\n");
+	return -ENOMEM;
+}
+
+/* add to the snapshot the keys created since its last change */
+static void snapshot_add_keys()
+{
+	struct keyzen_snapshot_header *h = snapshot_header;
+	struct keyzen_snapshot_key *keys;
+	const char *name;
+	uint32_t length, names;
+	int kid, kcount, l, u, i;
+
+	names = snapshot_names_used;
+	for (kcount = (int)h->key_count ; keyset_is_valid_keyid(kcount) ; kcount++)
+		names += (uint32_t)strlen(keyset_key(kcount));
+	if ((uint32_t)kcount > h->row_size || names > snapshot_names_alloc) {
+		snapshot_build();
+		return;
+	}
+
+	keys = SNAPSHOT_KEYS(h);
+	snapshot_begin();
+	for (kid = (int)h->key_count ; kid < kcount ; kid++) {
+		name = keyset_key(kid);
+		length = (uint32_t)strlen(name);
+
+		/* dichotomic search of the place */
+		l = 0;
+		u = (int)h->key_count;
+		while (l < u) {
+			i = (l + u) >> 1;
+			if (snapshot_compare_key(name, length, &keys[i]) < 0)
+				u = i;
+			else
+				l = i + 1;
+		}
+
+		memmove(&keys[l + 1], &keys[l], (h->key_count - (uint32_t)l) * sizeof * keys);
+		keys[l].kid = (uint32_t)kid;
+		keys[l].offset = snapshot_names_used;
+		keys[l].length = length;
+		memcpy(SNAPSHOT_NAMES(h) + snapshot_names_used, name, length);
+		snapshot_names_used += length;
+		h->key_count++;
+	}
+	snapshot_end();
+}
+
+/* add the row of the process 'pid' of 'keyset' */
+static void snapshot_add_process(int pid, int keyset)
+{
+	struct keyzen_snapshot_header *h = snapshot_header;
+	uint32_t *pids;
+	int row;
+
+	if (!snapshot_is_on() || pid <= 0 || pid >= KEYZEN_SNAPSHOT_PIDS)
+		return;
+
+	pids = SNAPSHOT_PIDS(h);
+	row = (int)pids[pid] - 1;
+	if (row < 0) {
+		row = snapshot_row_free;
+		if (row < 0) {
+			/* no free row, build again with more rows */
+			snapshot_build();
+			row = snapshot_row_free;
+			if (row < 0)
+				return;
+		}
+		snapshot_row_free = snapshot_rows[row].keyset;
+	}
+	snapshot_rows[row].pid = pid;
+	snapshot_rows[row].keyset = keyset;
+	snapshot_rows[row].start = snapshot_start_of(pid);
+
+	snapshot_begin();
+	memset(SNAPSHOT_ROW(h, row), 0, h->row_size);
+	keyset_for_all_not_null(keyset, snapshot_set_row, SNAPSHOT_ROW(h, row));
+	SNAPSHOT_STARTS(h)[row] = snapshot_rows[row].start;
+	pids[pid] = (uint32_t)row + 1;
+	snapshot_end();
+}
+
+/* remove the row of the process 'pid' */
+static void snapshot_remove_process(int pid)
+{
+	uint32_t *pids;
+	int row;
+
+	if (!snapshot_is_on() || pid <= 0 || pid >= KEYZEN_SNAPSHOT_PIDS)
+		return;
+
+	pids = SNAPSHOT_PIDS(snapshot_header);
+	row = (int)pids[pid] - 1;
+	if (row >= 0) {
+		snapshot_begin();
+		pids[pid] = 0;
+		snapshot_end();
+		snapshot_rows[row].pid = 0;
+		snapshot_rows[row].keyset = snapshot_row_free;
+		snapshot_row_free = row;
+	}
+}
+
+/* set the mode of the key 'kid' of the process 'pid' to 'value' */
+static void snapshot_set_mode(int pid, int kid, char value)
+{
+	struct keyzen_snapshot_header *h = snapshot_header;
+	int row;
+
+	if (!snapshot_is_on() || pid <= 0 || pid >= KEYZEN_SNAPSHOT_PIDS)
+		return;
+
+	row = (int)SNAPSHOT_PIDS(h)[pid] - 1;
+	if (row < 0)
+		return;
+	if ((uint32_t)kid >= h->key_count) {
+		/* the new keys may build it again with the value */
+		snapshot_add_keys();
+		if (!snapshot_is_on())
+			return;
+		row = (int)SNAPSHOT_PIDS(h)[pid] - 1;
+	}
+
+	snapshot_begin();
+	SNAPSHOT_ROW(h, row)[kid] = value;
+	snapshot_end();
+}
+
+/* stop receiving the exits, the rows are then checked by their start only */
+static void snapshot_unwatch_exits()
+{
+	if (snapshot_exits >= 0) {
+		close(snapshot_exits);
+		snapshot_exits = -1;
+	}
+	if (snapshot_header && (snapshot_header->flags & KEYZEN_SNAPSHOT_EXITS)) {
+		snapshot_begin();
+		snapshot_header->flags &= ~(uint32_t)KEYZEN_SNAPSHOT_EXITS;
+		snapshot_end();
+	}
+}
+
+/* listen to the exits of the processes, needs CAP_NET_ADMIN */
+static int snapshot_watch_exits()
+{
+	struct sockaddr_nl addr;
+	struct {
+		struct nlmsghdr header;
+		struct cn_msg msg;
+		enum proc_cn_mcast_op op;
+	} __attribute__((packed)) request;
+	int fd;
+
+	fd = socket(PF_NETLINK, SOCK_DGRAM|SOCK_NONBLOCK|SOCK_CLOEXEC, NETLINK_CONNECTOR);
+	if (fd < 0)
+		return -errno;
+	memset(&addr, 0, sizeof addr);
+	addr.nl_family = AF_NETLINK;
+	addr.nl_groups = CN_IDX_PROC;
+	memset(&request, 0, sizeof request);
+	request.header.nlmsg_len = sizeof request;
+	request.header.nlmsg_type = NLMSG_DONE;
+	request.msg.id.idx = CN_IDX_PROC;
+	request.msg.id.val = CN_VAL_PROC;
+	request.msg.len = sizeof request.op;
+	request.op = PROC_CN_MCAST_LISTEN;
+	if (bind(fd, (struct sockaddr*)&addr, sizeof addr) < 0
+	 || send(fd, &request, sizeof request, 0) < 0) {
+		close(fd);
+		return -errno;
+	}
+	snapshot_exits = fd;
+	return 0;
+}
+
+/* drop the rows of the processes that exited */
+static void snapshot_receive_exits()
+{
+	char buffer[4096] __attribute__((aligned(NLMSG_ALIGNTO)));
+	struct sockaddr_nl addr;
+	socklen_t length;
+	struct nlmsghdr *header;
+	struct cn_msg *msg;
+	struct proc_event *event;
+	ssize_t rc;
+
+	for (;;) {
+		length = sizeof addr;
+		rc = recvfrom(snapshot_exits, buffer, sizeof buffer, 0, (struct sockaddr*)&addr, &length);
+		if (rc < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN) {
+				/* exits were lost (ENOBUFS) */
+				fprintf(stderr, "keyzen-fs: exits of processes lost: %m\n");
+				snapshot_unwatch_exits();
+			}
+			return;
+		}
+		if (length != sizeof addr || addr.nl_pid != 0)
+			continue; /* not from the kernel */
+
+		for (header = (struct nlmsghdr*)buffer ; NLMSG_OK(header, (size_t)rc) ; header = NLMSG_NEXT(header, rc)) {
+			msg = NLMSG_DATA(header);
+			if (header->nlmsg_type != NLMSG_DONE || msg->id.idx != CN_IDX_PROC
+			 || header->nlmsg_len < NLMSG_LENGTH(sizeof * msg + sizeof * event))
+				continue;
+			event = (struct proc_event*)msg->data;
+			if (event->what == PROC_EVENT_EXIT
+			 && event->event_data.exit.process_pid == event->event_data.exit.process_tgid) {
+				lock();
+				snapshot_remove_process(event->event_data.exit.process_pid);
+				unlock();
+			}
+		}
+	}
+}
+
+/* mark the snapshot mapped at 'header' as closed */
+static void snapshot_mark_closed(struct keyzen_snapshot_header *header)
+{
+	__atomic_store_n(&header->seq, header->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	header->state = KEYZEN_SNAPSHOT_CLOSED;
+	__atomic_store_n(&header->seq, header->seq + 1, __ATOMIC_RELEASE);
+}
+
+/*
+publish the snapshot at 'snapshot_path'. the file is created aside
+and then renamed, so the clients of a previous instance, that is
+marked as closed, keep their mapping valid.
+*/
+static int snapshot_open()
+{
+	char *temp;
+	void *map;
+	int fd, sts;
+
+	if (!snapshot_path || !*snapshot_path)
+		return 0;
+
+	/* close the previous one */
+	fd = open(snapshot_path, O_RDWR|O_CLOEXEC);
+	if (fd >= 0) {
+		map = mmap(0, sizeof * snapshot_header, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+		if (map != MAP_FAILED) {
+			if (((struct keyzen_snapshot_header*)map)->magic == KEYZEN_SNAPSHOT_MAGIC)
+				snapshot_mark_closed(map);
+			munmap(map, sizeof * snapshot_header);
+		}
+		close(fd);
+	}
+
+	/* create the new one */
+	temp = malloc(strlen(snapshot_path) + 8);
+	if (!temp)
+		return -ENOMEM;
+	strcpy(stpcpy(temp, snapshot_path), ".XXXXXX");
+	fd = mkstemp(temp);
+	if (fd < 0) {
+		sts = -errno;
+		free(temp);
+		return sts;
+	}
+	map = mmap(0, KEYZEN_SNAPSHOT_MAX, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED || fchmod(fd, 0444) < 0 || ftruncate(fd, sizeof * snapshot_header) < 0) {
+		sts = -errno;
+		goto error;
+	}
+
+	snapshot_fd = fd;
+	snapshot_header = map;
+	snapshot_length = sizeof * snapshot_header;
+	snapshot_header->version = KEYZEN_SNAPSHOT_VERSION;
+	snapshot_header->state = KEYZEN_SNAPSHOT_ALIVE;
+	if (snapshot_exits >= 0 || !snapshot_watch_exits())
+		snapshot_header->flags = KEYZEN_SNAPSHOT_EXITS;
+	sts = snapshot_build();
+	if (!sts && rename(temp, snapshot_path) < 0)
+		sts = -errno;
+	if (sts)
+		goto error;
+	__atomic_store_n(&snapshot_header->magic, KEYZEN_SNAPSHOT_MAGIC, __ATOMIC_RELEASE);
+	free(temp);
+	return 0;
+
+error:
+	if (map != MAP_FAILED)
+		munmap(map, KEYZEN_SNAPSHOT_MAX);
+	snapshot_header = 0;
+	snapshot_fd = -1;
+	snapshot_unwatch_exits();
+	close(fd);
+	unlink(temp);
+	free(temp);
+	return sts;
+}
+
+static void snapshot_close()
+{
+	if (snapshot_header) {
+		snapshot_mark_closed(snapshot_header);
+		unlink(snapshot_path);
+		munmap(snapshot_header, KEYZEN_SNAPSHOT_MAX);
+		close(snapshot_fd);
+		snapshot_header = 0;
+		snapshot_fd = -1;
+	}
+	snapshot_unwatch_exits();
+}
+
 /*====================================================*/
 /*===================== PROCESS ======================*/
 /*====================================================*/
@@ -86,12 +823,22 @@ struct process {
 	const char *name;
 	int keyset;
 	int pid;
+	unsigned long generation;
+	int identified;
+	uint64_t session;
+	dev_t exe_dev;
+	ino_t exe_ino;
+	int described;
+	uid_t uid;
+	char *exe;
+	char *cgroup;
 };
 
 static struct process *first = 0;
 static struct process *unused = 0;
 static int dirty = 0;
 static int should_update = 0;
+static unsigned long generation = 0;
 
 
 static int process_check_process_exists_name(const char *name)
@@ -127,32 +874,48 @@ static void process_init_stat(struct stat *stbuf, struct process *process)
 	}
 }
 
-static int process_keys_set(struct process *process, const char *key)
+/*
+set the mode of the key 'kid' of 'process' to 'value' and
+change the generation of 'process' when it differs
+*/
+static void process_set_mode(struct process *process, int kid, char value)
 {
-	int kid;
-	char value;
+	if (keyset_get(process->keyset, kid) != value) {
+		keyset_set(process->keyset, kid, value);
+		process->generation = __atomic_add_fetch(&generation, 1, __ATOMIC_RELAXED);
+		snapshot_set_mode(process->pid, kid, value);
+	}
+}
 
-	switch (*key) {
+/* get the mode prefixing the '*key' and skip it */
+static char key_mode(const char **key)
+{
+	switch (**key) {
 	case CHAR_BLANCKET:	/* '!' */
 	case CHAR_SESSION:	/* '+' */
 	case CHAR_ONE_SHOT: /* '*' */
 	case CHAR_PERMIT:	/* '=' */
-		value = *key++;
-		break;
+		return *(*key)++;
 	case CHAR_DENY:		/* '-' */
-		key++;
-		value = 0;
-		break;
+		(*key)++;
+		return 0;
 	default:
-		value = CHAR_PERMIT;
-		break;
+		return CHAR_PERMIT;
 	}
+}
+
+static int process_keys_set(struct process *process, const char *key)
+{
+	int kid;
+	char value;
 
+	value = key_mode(&key);
 	kid = keyset_keyid(key, 1);
 	if (kid < 0)
 		return kid;
 
-	keyset_set(process->keyset, kid, value);
+	process_set_mode(process, kid, value);
+	events_printf("set %d %c%s\n", process->pid, value ? value : CHAR_DENY, key);
 	return 0;
 }
 
@@ -176,7 +939,8 @@ static int process_keys_drop(struct process *process, const char *key)
 	if (kid < 0)
 		return kid;
 
-	keyset_set(process->keyset, kid, 0);
+	process_set_mode(process, kid, 0);
+	events_printf("drop %d %s\n", process->pid, key);
 	return 0;
 }
 
@@ -254,6 +1018,94 @@ static int process_init_keys(struct process *process)
 	return 0;
 }
 
+/*
+identifies the session and the executable of the process for the
+recorded decisions. the session is the audit session plus one when
+set, else the session of the process tagged with bit 32 to avoid
+collisions. a session of 0 means unknown.
+*/
+static void process_identify(struct process *process)
+{
+	char buffer[PATH_MAX];
+	struct stat st;
+	unsigned long sessionid;
+	pid_t sid;
+	FILE *file;
+
+	if (process->identified)
+		return;
+
+	process->session = 0;
+	strcpy(stpcpy(stpcpy(buffer, "/proc/"), process->name), "/sessionid");
+	file = fopen(buffer, "r");
+	if (file) {
+		if (fscanf(file, "%lu", &sessionid) == 1 && sessionid != (uint32_t)-1)
+			process->session = (uint64_t)sessionid + 1;
+		fclose(file);
+	}
+	if (!process->session) {
+		sid = getsid(process->pid);
+		if (sid > 0)
+			process->session = ((uint64_t)1 << 32) | (uint64_t)sid;
+	}
+
+	strcpy(stpcpy(stpcpy(buffer, "/proc/"), process->name), "/exe");
+	if (stat(buffer, &st)) {
+		process->exe_dev = 0;
+		process->exe_ino = 0;
+	} else {
+		process->exe_dev = st.st_dev;
+		process->exe_ino = st.st_ino;
+	}
+	process->identified = 1;
+}
+
+/*
+describes the process for the agents: its user, its executable and its
+cgroup. the description is made once and kept for the life of the process.
+*/
+static void process_describe(struct process *process)
+{
+	char buffer[PATH_MAX], line[PATH_MAX + 32], *path;
+	struct stat st;
+	ssize_t size;
+	FILE *file;
+
+	if (process->described)
+		return;
+
+	process_identify(process);
+
+	strcpy(stpcpy(buffer, "/proc/"), process->name);
+	process->uid = stat(buffer, &st) ? (uid_t)-1 : st.st_uid;
+
+	strcpy(stpcpy(stpcpy(buffer, "/proc/"), process->name), "/exe");
+	size = readlink(buffer, line, sizeof line - 1);
+	if (size > 0) {
+		line[size] = 0;
+		process->exe = strdup(line);
+	}
+
+	/* the unified hierarchy or else the first one */
+	strcpy(stpcpy(stpcpy(buffer, "/proc/"), process->name), "/cgroup");
+	file = fopen(buffer, "r");
+	if (file) {
+		while (fgets(line, sizeof line, file)) {
+			path = strchr(line, ':');
+			path = path ? strchr(path + 1, ':') : 0;
+			if (path) {
+				path[strcspn(path, "\n")] = 0;
+				free(process->cgroup);
+				process->cgroup = strdup(path + 1);
+				if (!strncmp(line, "0::", 3))
+					break;
+			}
+		}
+		fclose(file);
+	}
+	process->described = 1;
+}
+
 static void *create_process(const char *pid)
 {
 	struct process *process;
@@ -271,8 +1123,14 @@ static void *create_process(const char *pid)
 	process->name = pid;
 	process->pid = atoi(pid);
 	process->keyset = keyset_new();
+	process->generation = __atomic_add_fetch(&generation, 1, __ATOMIC_RELAXED);
+	process->identified = 0;
+	process->described = 0;
+	process->exe = 0;
+	process->cgroup = 0;
 	process->next = first;
 	first = process;
+	snapshot_add_process(process->pid, process->keyset);
 	process_init_keys(process);
 	return process;
 }
@@ -281,7 +1139,13 @@ static void destroy_process(void *data)
 {
 	if (data) {
 		struct process *process = data;
+		events_printf("exit %d\n", process->pid);
+		snapshot_remove_process(process->pid);
 		process->name = 0;
+		free(process->exe);
+		free(process->cgroup);
+		process->exe = 0;
+		process->cgroup = 0;
 		dirty = 1;
 	}
 }
@@ -428,22 +1292,53 @@ static void stat_dial(struct stat *stbuf)
 	stbuf->st_ctime = root_time;
 }
 
-static void stat_process(struct stat *stbuf, struct process *process)
+static void stat_events(struct stat *stbuf)
 {
-	process_init_stat(stbuf, process);
-	stbuf->st_ino = MK_INODE_DIR(process->pid);
-	stbuf->st_mode = S_IFDIR | 0755;
-	stbuf->st_nlink = 2;
+	memset(stbuf, 0, sizeof(*stbuf));
+	stbuf->st_ino = INODE_EVENTS;
+	stbuf->st_mode = S_IFREG | 0444;
+	stbuf->st_nlink = 1;
+	stbuf->st_atime = root_time;
+	stbuf->st_mtime = root_time;
+	stbuf->st_ctime = root_time;
+}
+
+static void stat_process(struct stat *stbuf, struct process *process)
+{
+	process_init_stat(stbuf, process);
+	stbuf->st_ino = MK_INODE_DIR(process->pid);
+	stbuf->st_mode = S_IFDIR | 0755;
+	stbuf->st_nlink = 2;
 }
 
 static void stat_key(struct stat *stbuf, struct process *process, int kid)
 {
 	process_init_stat(stbuf, process);
 	stbuf->st_ino = MK_INODE_KEY(process->pid,kid);
-	stbuf->st_mode = S_IFREG | 0000;
+	stbuf->st_mode = S_IFREG | 0444;
+	stbuf->st_nlink = 1;
+}
+
+static void stat_ctl(struct stat *stbuf, struct process *process, int ctl)
+{
+	process_init_stat(stbuf, process);
+	stbuf->st_ino = MK_INODE_CTL(process->pid,ctl);
+	stbuf->st_mode = S_IFREG | (ctl == CTL_LIST ? 0444 : ctl == CTL_UPDATE ? 0222 : 0666);
 	stbuf->st_nlink = 1;
 }
 
+/* get the control file of 'name' or 0 if none */
+static int ctl_of_name(const char *name)
+{
+	if (!strcmp(name, KEYZEN_QUERY_NAME))
+		return CTL_QUERY;
+	if (!strcmp(name, KEYZEN_UPDATE_NAME))
+		return CTL_UPDATE;
+	if (!strcmp(name, KEYZEN_LIST_NAME))
+		return CTL_LIST;
+	return 0;
+}
+
 /*====================================================*/
 /*===================== FDBUF ========================*/
 /*====================================================*/
@@ -535,351 +1430,2371 @@ num = digit digit*
 digit = '0' | '1' | '2' | '3' | '4' | '5' | '6' | '7' | '8' | '9'
 type = '-' | '=' | '*' | '+' | '!'
 grant = 'y' | 'n'
+
+a read of FS delivers as many complete lines as fitting
+its size and a write to FS can carry many lines.
+
+when opened with O_NONBLOCK, a read with no pending line
+fails with EAGAIN and the file can be polled.
+
+the control line "binary 1" switches the file to the binary
+records described in keyzen-dial.h.
+
+the control line "context 1" adds to the requests the user,
+the session, the executable and the cgroup of the process as
+described in keyzen-dial.h.
+*/
+
+#define SEQ_MAX				999999	/* greatest value of seq */
+#define SEQ_DIGITS			6		/* count of digits of SEQ_MAX */
+#define PAK_HASH_SIZE		256		/* count of buckets of seq, MUST be a power of 2 */
+#define PAK_MAX_PENDING		4096	/* maximum count of pending queries */
+#define PAK_MAX_PER_PID		64		/* maximum count of pending queries of a process */
+#define DIAL_TIMEOUT		60000	/* default deadline of answers in ms, 0 for none */
+#define DIAL_TICK			100		/* resolution of deadlines in ms */
+#define DIAL_GRACE			5000	/* default delay in ms for an agent to come back */
+
+#define PAK_HASH(seq)		(assert(!(PAK_HASH_SIZE & (PAK_HASH_SIZE - 1))), ((seq) & (PAK_HASH_SIZE - 1)))
+#define PAK_HASH_INO(ino)	PAK_HASH((int)(ino) ^ INODE_PID(ino))
+
+/*
+the pending queries are either unsent, then in the FIFO
+of unsent queries of their process with a seq of 0, or sent
+to the server, then in the hash table of their seq.
+
+the processes having unsent queries are served in round
+robin: the first query of the first process is sent and the
+process goes at the end of the active processes. A process
+can't have more than PAK_MAX_PER_PID queries pending, not
+counting the coalesced ones, the queries above it fail with
+EBUSY.
+
+the queries for the same key of the same process are
+coalesced: only the first is in the hash table of the inodes
+and in the FIFO or the hash of seq, the others are chained
+to it through 'same' and get the same answer.
+
+the first query also holds the timer of the deadline of
+the answer. On expiration, all the queries chained to it
+are replied with the default verdict.
+
+the queries sent to an agent that goes away unanswered are
+put back in the FIFO for the other agents. When the last
+agent goes, the queries wait for a new agent during a grace
+period and are then replied with the default verdict.
+*/
+enum pak_states {
+	pak_unsent,
+	pak_sent
+};
+
+/*
+the queries of a process
+*/
+struct pak_queue {
+	struct pak_queue *next;				/* next active queue or next free */
+	struct pak_queue *prev;				/* previous active queue */
+	struct pak_queue *hnext;			/* next in the same pid bucket */
+	struct pending_access_key *first;	/* first unsent query */
+	struct pending_access_key *last;	/* last unsent query */
+	int pid;
+	int count;							/* count of pending queries */
+	int queries;						/* count of pending queries not coalesced */
+};
+
+/*
+a key file opened for reading delivers the verdict of the key
 */
+struct key_file {
+	struct pending_access_key *pak;		/* query in progress or null */
+	struct query_file *query;			/* query file of the key or null */
+	fuse_req_t read_req;				/* blocked read or null */
+	struct fuse_pollhandle *poll_handle;
+	int nonblock;
+	int error;							/* error of the query */
+	char verdict;						/* 'Y', 'N' or '?' while pending */
+};
+
+/*
+a query file checks the keys written in it
+*/
+struct query_file {
+	struct key_file **keys;				/* the keys in the order of writing */
+	int count;							/* count of keys */
+	int alloc;							/* allocated count of keys */
+	int pending;						/* count of keys without verdict */
+	int failfast;						/* skip the keys after a failure */
+	int failed;							/* a key of the query failed */
+	int pid;							/* pid of the process */
+	fuse_req_t read_req;				/* blocked read or null */
+	size_t read_size;					/* size of the blocked read */
+	struct fuse_pollhandle *poll_handle;
+	int nonblock;
+	size_t length;						/* length of the incomplete line */
+	char line[NAME_MAX + 1];			/* incomplete line */
+};
 
 struct pending_access_key {
-	struct pending_access_key *next;
+	struct pending_access_key *next;	/* next unsent or next free */
+	struct pending_access_key *prev;	/* previous unsent */
+	struct pending_access_key *hnext;	/* next in the same hash bucket */
+	struct pending_access_key *inext;	/* next in the same inode bucket */
+	struct pending_access_key *same;	/* next coalesced query */
+	struct wheel_timer timer;			/* deadline of the answer */
+	struct dial_agent *agent;			/* agent of the sent query */
+	struct pak_queue *queue;			/* queries of the process */
+	struct key_file *file;				/* waiting key file or null */
 	fuse_req_t req;
 	fuse_ino_t ino;
 	int seq;
+	char mode;							/* mode of the key when queried */
+	enum pak_states state;
 };
 
-static struct pending_access_key *pak_first_free = 0;
-static struct pending_access_key *pak_first_pending = 0;
-static struct pending_access_key *pak_last_pending = 0;
+/* forget the keys of the query, the pending queries continue without it */
+static void query_file_reset(struct query_file *query)
+{
+	int i;
+
+	for (i = 0 ; i < query->count ; i++) {
+		if (query->keys[i]->pak)
+			query->keys[i]->pak->file = 0;
+		free(query->keys[i]);
+	}
+	query->count = 0;
+	query->pending = 0;
+	query->failfast = 0;
+	query->failed = 0;
+}
+
+/* reply to 'req' the verdicts of the keys and forget them when all are known */
+static void query_file_send(struct query_file *query, fuse_req_t req, size_t size)
+{
+	char verdicts[KEYZEN_QUERY_MAX];
+	struct key_file *file;
+	int i;
+
+	if (size < (size_t)query->count) {
+		fuse_reply_err(req, EOVERFLOW);
+		return;
+	}
+	for (i = 0 ; i < query->count ; i++) {
+		file = query->keys[i];
+		if (file->pak || !file->error)
+			verdicts[i] = file->verdict;
+		else if (file->error == ECANCELED)
+			verdicts[i] = 'S';
+		else
+			verdicts[i] = file->error == ENOENT ? 'X' : 'E';
+	}
+	fuse_reply_buf(req, verdicts, (size_t)i);
+	if (!query->pending)
+		query_file_reset(query);
+}
+
+/* all the keys of the query are decided, wakes up its readers */
+static void query_file_decided(struct query_file *query)
+{
+	if (query->read_req) {
+		query_file_send(query, query->read_req, query->read_size);
+		query->read_req = 0;
+	}
+	if (query->poll_handle) {
+		fuse_lowlevel_notify_poll(query->poll_handle);
+		fuse_pollhandle_destroy(query->poll_handle);
+		query->poll_handle = 0;
+	}
+}
+
+/* records the verdict 'sts' of the key file and wakes up its readers */
+static void key_file_decided(struct key_file *file, int sts)
+{
+	file->pak = 0;
+	file->error = sts == 0 || sts == EPERM ? 0 : sts;
+	file->verdict = sts ? 'N' : 'Y';
+	if (file->query) {
+		/* the key of a query file */
+		if (sts)
+			file->query->failed = 1;
+		if (!--file->query->pending)
+			query_file_decided(file->query);
+		return;
+	}
+	if (file->read_req) {
+		if (file->error)
+			fuse_reply_err(file->read_req, file->error);
+		else
+			fuse_reply_buf(file->read_req, &file->verdict, 1);
+		file->read_req = 0;
+	}
+	if (file->poll_handle) {
+		fuse_lowlevel_notify_poll(file->poll_handle);
+		fuse_pollhandle_destroy(file->poll_handle);
+		file->poll_handle = 0;
+	}
+}
 
+static struct pending_access_key *pak_first_free = 0;
+static struct pak_queue *queue_first_free = 0;
+static struct pak_queue *queue_first_active = 0;
+static struct pak_queue *queue_last_active = 0;
+static struct pak_queue *queue_hash[PAK_HASH_SIZE];
+static struct pending_access_key *pak_hash[PAK_HASH_SIZE];
+static struct pending_access_key *pak_ino_hash[PAK_HASH_SIZE];
+static int pak_count = 0;
+
+static int dial_timeout = DIAL_TIMEOUT;
+static int dial_default_grant = 0;
+static unsigned long dial_timedout_count = 0;
+static int dial_grace = DIAL_GRACE;
+static unsigned long dial_abandoned_count = 0;
+static struct wheel_timer grace_timer;
 
-static int dialing = 0;
-static fuse_req_t  read_req = 0;
-static size_t read_size = 0;
-static size_t read_pos = 0;
-static size_t read_count = 0;
-static char read_buffer[2048];
 
 enum writing_states {
 	writing_seq,
 	writing_grant,
 	writing_type,
 	writing_eol,
+	writing_command,
 	writing_error
 };
 
-static enum writing_states write_state = writing_seq;
-static int write_seq = 0;
-static char write_grant = 0;
-static char write_type = 0;
+#define COMMAND_MAX			256		/* maximum length of control lines */
+
+/*
+the shared memory ring of an agent, see keyzen-dial.h
+*/
+struct dial_ring {
+	struct keyzen_ring_header *header;
+	struct keyzen_ring_request *requests;
+	struct keyzen_ring_answer *answers;
+	size_t size;
+	uint32_t request_count;
+	uint32_t answer_count;
+	int evreq;
+	int evans;
+};
+
+/*
+the servers opening dial are the agents. Each agent has its
+own read buffer and its own state of parsing of its writes.
+*/
+struct dial_agent {
+	struct dial_agent *next;
+	fuse_req_t read_req;
+	size_t read_size;
+	size_t read_pos;
+	size_t read_count;
+	size_t read_alloc;
+	char *read_buffer;
+	enum writing_states write_state;
+	int write_seq;
+	char write_grant;
+	char write_type;
+	int nonblock;
+	struct fuse_pollhandle *poll_handle;
+	size_t command_length;
+	char command[COMMAND_MAX];
+	struct dial_ring ring;
+	int context;
+	int binary;
+	size_t record_length;
+	size_t record_skip;
+	union {
+		struct keyzen_record head;
+		struct keyzen_answer_record answer;
+		char data[sizeof(struct keyzen_record) + COMMAND_MAX];
+	} record;
+};
+
+static struct dial_agent *agent_first = 0;
+static struct dial_agent *agent_cursor = 0;
+static int agent_count = 0;
+static int pak_unsent_count = 0;
 
 static int last_seq = 0;
 
-static int dial_is_started()
+/* get the queue of pid, creating it if needed, must be called with dial locked */
+static struct pak_queue *queue_get(int pid)
 {
-	return dialing;
+	struct pak_queue *queue;
+	int h;
+
+	h = PAK_HASH(pid);
+	queue = queue_hash[h];
+	while (queue && queue->pid != pid)
+		queue = queue->hnext;
+	if (!queue) {
+		queue = queue_first_free;
+		if (queue)
+			queue_first_free = queue->next;
+		else {
+			queue = malloc(sizeof * queue);
+			if (!queue)
+				return 0;
+		}
+		queue->first = queue->last = 0;
+		queue->next = queue->prev = 0;
+		queue->pid = pid;
+		queue->count = 0;
+		queue->queries = 0;
+		queue->hnext = queue_hash[h];
+		queue_hash[h] = queue;
+	}
+	return queue;
 }
 
-static void dial_start()
+/* set free the queue without pending queries, must be called with dial locked */
+static void queue_put(struct pak_queue *queue)
 {
-	assert(!dial_is_started());
-	dialing = 1;
+	struct pak_queue **prv;
+
+	assert(!queue->count);
+	assert(!queue->first);
+
+	prv = &queue_hash[PAK_HASH(queue->pid)];
+	while (*prv != queue) {
+		assert(*prv);
+		prv = &(*prv)->hnext;
+	}
+	*prv = queue->hnext;
+	queue->next = queue_first_free;
+	queue_first_free = queue;
 }
 
-static void dial_stop()
+/* get a free pending query for the queue, must be called with dial locked */
+static struct pending_access_key *pak_alloc(struct pak_queue *queue)
 {
-	assert(dial_is_started());
-	dialing = 0;
+	struct pending_access_key *pak;
+
+	pak = pak_first_free;
+	if (pak)
+		pak_first_free = pak->next;
+	else {
+		pak = malloc(sizeof * pak);
+		if (!pak)
+			return 0;
+	}
+	pak_count++;
+	queue->count++;
+	pak->queue = queue;
+	return pak;
+}
+
+/* set free the pending query, must be called with dial locked */
+static void pak_free(struct pending_access_key *pak)
+{
+	assert(pak_count > 0);
+	assert(pak->queue->count > 0);
+
+	pak_count--;
+	if (!--pak->queue->count)
+		queue_put(pak->queue);
+	pak->next = pak_first_free;
+	pak_first_free = pak;
+}
+
+/* search the sent query of seq, must be called with dial locked */
+static struct pending_access_key *pak_search(int seq)
+{
+	struct pending_access_key *pak;
+
+	pak = pak_hash[PAK_HASH(seq)];
+	while (pak && pak->seq != seq)
+		pak = pak->hnext;
+	return pak;
+}
+
+/* extract the sent query of seq, must be called with dial locked */
+static struct pending_access_key *pak_extract(int seq)
+{
+	struct pending_access_key *pak, **prv;
+
+	prv = &pak_hash[PAK_HASH(seq)];
+	pak = *prv;
+	while (pak && pak->seq != seq) {
+		prv = &pak->hnext;
+		pak = *prv;
+	}
+	if (pak)
+		*prv = pak->hnext;
+	return pak;
+}
+
+/* search the query in progress for ino, must be called with dial locked */
+static struct pending_access_key *pak_search_ino(fuse_ino_t ino)
+{
+	struct pending_access_key *pak;
+
+	pak = pak_ino_hash[PAK_HASH_INO(ino)];
+	while (pak && pak->ino != ino)
+		pak = pak->inext;
+	return pak;
+}
+
+/* record the query in progress for its ino, must be called with dial locked */
+static void pak_add_ino(struct pending_access_key *pak)
+{
+	int h;
+
+	assert(!pak_search_ino(pak->ino));
+
+	h = PAK_HASH_INO(pak->ino);
+	pak->inext = pak_ino_hash[h];
+	pak_ino_hash[h] = pak;
+}
+
+/* forget the query in progress for its ino, must be called with dial locked */
+static void pak_remove_ino(struct pending_access_key *pak)
+{
+	struct pending_access_key **prv;
+
+	prv = &pak_ino_hash[PAK_HASH_INO(pak->ino)];
+	while (*prv != pak) {
+		assert(*prv);
+		prv = &(*prv)->inext;
+	}
+	*prv = pak->inext;
+}
+
+/* gives a fresh seq to the unsent query, must be called with dial locked */
+static void pak_set_sent(struct pending_access_key *pak)
+{
+	int h;
+
+	assert(pak->state == pak_unsent);
+	assert(pak_count <= SEQ_MAX);
+
+	do {
+		last_seq = (last_seq % SEQ_MAX) + 1;
+	} while(pak_search(last_seq));
+	pak->seq = last_seq;
+	pak->state = pak_sent;
+	h = PAK_HASH(last_seq);
+	pak->hnext = pak_hash[h];
+	pak_hash[h] = pak;
+}
+
+/* append the queue to the active queues, must be called with dial locked */
+static void queue_activate_last(struct pak_queue *queue)
+{
+	queue->next = 0;
+	queue->prev = queue_last_active;
+	if (queue_last_active)
+		queue_last_active->next = queue;
+	else
+		queue_first_active = queue;
+	queue_last_active = queue;
+}
+
+/* remove the queue from the active queues, must be called with dial locked */
+static void queue_deactivate(struct pak_queue *queue)
+{
+	if (queue->prev)
+		queue->prev->next = queue->next;
+	else
+		queue_first_active = queue->next;
+	if (queue->next)
+		queue->next->prev = queue->prev;
+	else
+		queue_last_active = queue->prev;
+}
+
+/* add the query to the unsent FIFO of its process, must be called with dial locked */
+static void pak_push_unsent(struct pending_access_key *pak)
+{
+	struct pak_queue *queue;
+
+	queue = pak->queue;
+	pak_unsent_count++;
+	pak->state = pak_unsent;
+	pak->seq = 0;
+	pak->next = 0;
+	pak->prev = queue->last;
+	if (queue->last)
+		queue->last->next = pak;
+	else {
+		queue->first = pak;
+		queue_activate_last(queue);
+	}
+	queue->last = pak;
+}
+
+/* put back the query at the head of the unsent FIFO of its process, must be called with dial locked */
+static void pak_unpop_unsent(struct pending_access_key *pak)
+{
+	struct pak_queue *queue;
+
+	queue = pak->queue;
+	pak_unsent_count++;
+	pak->state = pak_unsent;
+	pak->seq = 0;
+	pak->prev = 0;
+	pak->next = queue->first;
+	if (queue->first)
+		queue->first->prev = pak;
+	else {
+		queue->last = pak;
+		/* the process is served first */
+		queue->prev = 0;
+		queue->next = queue_first_active;
+		if (queue_first_active)
+			queue_first_active->prev = queue;
+		else
+			queue_last_active = queue;
+		queue_first_active = queue;
+	}
+	queue->first = pak;
+}
+
+/* remove the query from the unsent FIFO of its process, must be called with dial locked */
+static void pak_remove_unsent(struct pending_access_key *pak)
+{
+	struct pak_queue *queue;
+
+	assert(pak->state == pak_unsent);
+
+	queue = pak->queue;
+	pak_unsent_count--;
+	if (pak->prev)
+		pak->prev->next = pak->next;
+	else
+		queue->first = pak->next;
+	if (pak->next)
+		pak->next->prev = pak->prev;
+	else
+		queue->last = pak->prev;
+	if (!queue->first)
+		queue_deactivate(queue);
+}
+
+/* get the first unsent query of the next process, must be called with dial locked */
+static struct pending_access_key *pak_pop_unsent()
+{
+	struct pak_queue *queue;
+	struct pending_access_key *pak;
+
+	queue = queue_first_active;
+	if (!queue)
+		return 0;
+
+	pak = queue->first;
+	pak_remove_unsent(pak);
+	if (queue->first) {
+		/* round robin */
+		queue_deactivate(queue);
+		queue_activate_last(queue);
+	}
+	return pak;
+}
+
+/* reply 'sts' to the access or to the key file */
+static void reply_access(fuse_req_t req, struct key_file *file, int sts)
+{
+	if (file)
+		key_file_decided(file, sts);
+	else if (req)
+		fuse_reply_err(req, sts);
+}
+
+/* reply 'sts' to the query and its coalesced queries and set them free */
+static int pak_reply(struct pending_access_key *pak, int sts)
+{
+	struct pending_access_key *iter;
+	int count;
+
+	count = 0;
+	for (iter = pak ; iter ; iter = iter->same) {
+		reply_access(iter->req, iter->file, sts);
+		count++;
+	}
+
+	diallock();
+	pak->queue->queries--;
+	while (pak) {
+		iter = pak->same;
+		pak_free(pak);
+		pak = iter;
+	}
+	dialunlock();
+	return count;
+}
+
+/* the deadline of the query expired */
+static void pak_expired(void *data)
+{
+	struct pending_access_key *pak;
+
+	pak = data;
+	diallock();
+	if (pak->state == pak_unsent)
+		pak_remove_unsent(pak);
+	else
+		pak_extract(pak->seq);
+	pak_remove_ino(pak);
+	dialunlock();
+
+	dial_timedout_count += pak_reply(pak, dial_default_grant ? 0 : EPERM);
+}
+
+/* put back in the unsent FIFO the queries sent to agent, must be called with dial locked */
+static void pak_requeue_agent(struct dial_agent *agent)
+{
+	struct pending_access_key *pak, **prv;
+	int h;
+
+	for (h = 0 ; h < PAK_HASH_SIZE ; h++) {
+		prv = &pak_hash[h];
+		while ((pak = *prv)) {
+			if (pak->agent != agent)
+				prv = &pak->hnext;
+			else {
+				*prv = pak->hnext;
+				pak_unpop_unsent(pak);
+			}
+		}
+	}
+}
+
+/*
+reply the pending queries of the key 'kid' that are decided by the decision
+for 'session' just given to 'process': the queries of the processes of the
+same executable in the same session or for any session.
+*/
+static void pak_reply_decided(struct process *process, uint64_t session, int kid, char type, int sts)
+{
+	struct pending_access_key *pak, **prv, *list;
+	struct process *other;
+	int h;
+
+	/* extract the decided queries */
+	list = 0;
+	diallock();
+	for (h = 0 ; h < PAK_HASH_SIZE ; h++) {
+		prv = &pak_ino_hash[h];
+		while ((pak = *prv)) {
+			other = INODE_KEY(pak->ino) != kid ? 0 : find_process_pid(INODE_PID(pak->ino));
+			if (other) {
+				process_identify(other);
+				if (other->exe_ino != process->exe_ino || other->exe_dev != process->exe_dev
+				 || (session != DECISIONS_APPLICATION && other->session != session))
+					other = 0;
+			}
+			if (!other)
+				prv = &pak->inext;
+			else {
+				*prv = pak->inext;
+				if (pak->state == pak_unsent)
+					pak_remove_unsent(pak);
+				else
+					pak_extract(pak->seq);
+				if (wheel_is_armed(&pak->timer))
+					wheel_remove(&pak->timer);
+				process_set_mode(other, kid, type);
+				events_printf("verdict %d %c%c%s\n", other->pid, sts ? 'n' : 'y', type ? type : CHAR_DENY, keyset_key(kid));
+				pak->next = list;
+				list = pak;
+			}
+		}
+	}
+	dialunlock();
+
+	/* reply them */
+	while ((pak = list)) {
+		list = pak->next;
+		pak_reply(pak, sts);
+	}
 }
 
 static void dial_received(int seq, int granted, char type)
 {
-	struct pending_access_key *pak, *prv;
+	struct pending_access_key *pak;
 	fuse_ino_t ino;
-	fuse_req_t req;
 	struct process *process;
-	int kid;
+	uint64_t session;
+	int kid, sts;
+	char mode;
 
 	assert(seq > 0);
 
 	diallock();
 
 	/* search the pending request of seq */
-	prv = 0;
-	pak = pak_first_pending;
-	while (pak && pak->seq != seq) {
-		prv = pak;
-		pak = pak->next;
-	}
-
+	pak = pak_extract(seq);
 	if (!pak) {
 		/* not found ?? */
 		dialunlock();
 		return;
 	}
-
-	/* record data */
-	req = pak->req;
-	ino = pak->ino;
-
-	/* unlink pak and set it free */
-	if (prv)
-		prv->next = pak->next;
-	else
-		pak_first_pending = pak->next;
-	if (!pak->next)
-		pak_last_pending = prv;
-	pak->next = pak_first_free;
-	pak_first_free = pak;
+	pak_remove_ino(pak);
+	if (wheel_is_armed(&pak->timer))
+		wheel_remove(&pak->timer);
 	dialunlock();
 
 	/* treat now */
+	ino = pak->ino;
+	mode = pak->mode;
 	process = find_process_pid(INODE_PID(ino));
 	if (!process)
-		fuse_reply_err(req, ENOENT);
+		sts = ENOENT;
 	else {
 		kid = INODE_KEY(ino);
 		assert(keyset_is_valid_keyid(kid));
-		keyset_set(process->keyset, kid, type);
-		fuse_reply_err(req, granted ? 0 : EPERM);
+		process_set_mode(process, kid, type);
+		sts = granted ? 0 : EPERM;
+		events_printf("verdict %d %c%c%s\n", process->pid, granted ? 'y' : 'n', type ? type : CHAR_DENY, keyset_key(kid));
+	}
+
+	/* reply to all the coalesced queries */
+	pak_reply(pak, sts);
+
+	/*
+	record the decision for the session or for the application
+	following the mode of the key when queried, as agents may answer
+	with the resulting mode, unless the agent wants a one shot
+	*/
+	if (process && (mode == CHAR_SESSION || mode == CHAR_BLANCKET) && type != CHAR_ONE_SHOT) {
+		process_identify(process);
+		session = mode == CHAR_SESSION ? process->session : DECISIONS_APPLICATION;
+		if (process->exe_ino && (session || mode == CHAR_BLANCKET)) {
+			decisions_set(session, process->exe_dev, process->exe_ino, kid, granted ? 'y' : 'n');
+			pak_reply_decided(process, session, kid, type, sts);
+		}
 	}
 }
 
-static void send_read()
+static void send_read(struct dial_agent *agent)
 {
 	int sts;
 	size_t size;
 
-	assert(read_req);
+	assert(agent->read_req);
 
-	size = read_count - read_pos;
+	size = agent->read_count - agent->read_pos;
 	if (size) {
-		if (size > read_size)
-			size = read_size;
-		sts = fuse_reply_buf(read_req, read_buffer + read_pos, size);
+		if (size > agent->read_size)
+			size = agent->read_size;
+		sts = fuse_reply_buf(agent->read_req, agent->read_buffer + agent->read_pos, size);
 		if (!sts)
-			read_pos = read_pos + size;
+			agent->read_pos = agent->read_pos + size;
 		else {
-			fuse_reply_err(read_req, -sts);
-			read_pos = read_count;
+			fuse_reply_err(agent->read_req, -sts);
+			agent->read_pos = agent->read_count;
 		}
-		read_req = 0;
+		agent->read_req = 0;
 	}
 }
 
-static void process_pending_paks()
+/* ensure that the read buffer of agent can hold 'count' bytes */
+static int reserve_read_buffer(struct dial_agent *agent, size_t count)
 {
-	struct process *process;
-	int kid, i;
-	struct pending_access_key *pak, *p;
-	const char *str;
-	char type, *b;
+	size_t a;
+	void *p;
 
-	if (!read_req)
-		return;
+	if (count > agent->read_alloc) {
+		a = agent->read_alloc ? 2*agent->read_alloc : 4096;
+		while (a < count)
+			a *= 2;
+		p = realloc(agent->read_buffer, a);
+		if (!p)
+			return -ENOMEM;
+		agent->read_buffer = p;
+		agent->read_alloc = a;
+	}
+	return 0;
+}
 
-	/* send the rest of the buffer if needed */
-	send_read();
-	if (!read_req)
-		return;
+/* put in 'b' the line of the request and returns its length */
+/* put the string escaped for the context of requests, '-' if null */
+static char *put_escaped(char *p, const char *str)
+{
+	static const char hex[] = "0123456789abcdef";
+	unsigned char c;
 
-	/* search a pending request */
+	if (!str)
+		*p++ = '-';
+	else {
+		while ((c = (unsigned char)*str++)) {
+			if (c <= ' ' || c == '%' || c == 127) {
+				*p++ = '%';
+				*p++ = hex[c >> 4];
+				*p++ = hex[c & 15];
+			} else
+				*p++ = (char)c;
+		}
+	}
+	return p;
+}
+
+static size_t format_pak(char *b, struct pending_access_key *pak, struct process *process, int context)
+{
+	int kid, i;
+	const char *str;
+	char type, *p;
+
+	p = b;
+	p += _itoa(pak->seq, p);
+	*p++ = ' ';
+	str = process->name;
+	for (i = 0 ; !!(p[i] = str[i]) ; i++);
+	p += i;
+	*p++ = ' ';
+	if (context) {
+		p += _itoa((int)process->uid, p);
+		*p++ = ' ';
+		p += sprintf(p, "%llu", (unsigned long long)process->session);
+		*p++ = ' ';
+		p = put_escaped(p, process->exe);
+		*p++ = ' ';
+		p = put_escaped(p, process->cgroup);
+		*p++ = ' ';
+	}
+	kid = INODE_KEY(pak->ino);
+	type = keyset_get(process->keyset, kid);
+	*p++ = type ? type : CHAR_DENY;
+	str = keyset_key(kid);
+	for (i = 0 ; !!(p[i] = str[i]) ; i++);
+	p += i;
+	*p++ = '\n';
+	return (size_t)(p - b);
+}
+
+/* upper bound of the length of the line of the request */
+static size_t length_pak(struct pending_access_key *pak, struct process *process, int context)
+{
+	size_t length;
+
+	length = SEQ_DIGITS + strlen(process->name)
+			+ strlen(keyset_key(INODE_KEY(pak->ino))) + 4;
+	if (context)
+		length += 12 + 21 + 3 * (process->exe ? strlen(process->exe) : 1)
+			+ 3 * (process->cgroup ? strlen(process->cgroup) : 1) + 4;
+	return length;
+}
+
+/* put the field of 'length' bytes of 'data' at 'p' and returns the end */
+static char *put_field(char *p, int tag, const void *data, size_t length)
+{
+	struct keyzen_field *f;
+	size_t n;
+
+	f = (struct keyzen_field*)p;
+	f->tag = (uint16_t)tag;
+	f->length = (uint16_t)length;
+	memcpy(f + 1, data, length);
+	n = KEYZEN_RECORD_ALIGN(length);
+	memset((char*)(f + 1) + length, 0, n - length);
+	return (char*)(f + 1) + n;
+}
+
+/* length of the context fields of the binary record */
+static size_t length_context_fields(struct process *process)
+{
+	size_t length;
+
+	length = sizeof(struct keyzen_field) + 4;
+	length += sizeof(struct keyzen_field) + 8;
+	if (process->exe)
+		length += sizeof(struct keyzen_field) + KEYZEN_RECORD_ALIGN(strlen(process->exe));
+	if (process->cgroup)
+		length += sizeof(struct keyzen_field) + KEYZEN_RECORD_ALIGN(strlen(process->cgroup));
+	return length;
+}
+
+/* put in 'b' the binary record of the request and returns its length */
+static size_t format_pak_record(char *b, struct pending_access_key *pak, struct process *process, int context)
+{
+	struct keyzen_request_record *r;
+	const char *key;
+	size_t keylen, length;
+	uint32_t uid;
+	int kid;
+	char type, *p;
+
+	kid = INODE_KEY(pak->ino);
+	key = keyset_key(kid);
+	keylen = strlen(key);
+	length = KEYZEN_RECORD_ALIGN(sizeof * r + keylen);
+	if (context)
+		length += length_context_fields(process);
+
+	r = (struct keyzen_request_record*)b;
+	r->head.length = (uint32_t)length;
+	r->head.kind = KEYZEN_RECORD_REQUEST;
+	r->head.flags = 0;
+	r->seq = (uint32_t)pak->seq;
+	r->pid = (uint32_t)process->pid;
+	r->kid = (uint32_t)kid;
+	type = keyset_get(process->keyset, kid);
+	r->type = type ? type : CHAR_DENY;
+	r->reserved = 0;
+	r->keylen = (uint16_t)keylen;
+	memcpy(r + 1, key, keylen);
+	p = (char*)(r + 1) + keylen;
+	while ((size_t)(p - b) & 3)
+		*p++ = 0;
+	if (context) {
+		uid = (uint32_t)process->uid;
+		p = put_field(p, KEYZEN_FIELD_UID, &uid, sizeof uid);
+		p = put_field(p, KEYZEN_FIELD_SESSION, &process->session, sizeof process->session);
+		if (process->exe)
+			p = put_field(p, KEYZEN_FIELD_EXE, process->exe, strlen(process->exe));
+		if (process->cgroup)
+			p = put_field(p, KEYZEN_FIELD_CGROUP, process->cgroup, strlen(process->cgroup));
+	}
+	assert((size_t)(p - b) == length);
+	return length;
+}
+
+/* length of the binary record of the request */
+static size_t length_pak_record(struct pending_access_key *pak, struct process *process, int context)
+{
+	return KEYZEN_RECORD_ALIGN(sizeof(struct keyzen_request_record)
+			+ strlen(keyset_key(INODE_KEY(pak->ino))))
+		+ (context ? length_context_fields(process) : 0);
+}
+
+/* give to the agent at most 'quota' pending requests */
+static void agent_process_pending_paks(struct dial_agent *agent, int quota)
+{
+	struct process *process;
+	struct pending_access_key *pak;
+	size_t length;
+
+	/* send the rest of the buffer if needed */
+	send_read(agent);
+	if (!agent->read_req)
+		return;
+
+	/* packs as many requests as fitting the read size */
+	agent->read_count = 0;
+	agent->read_pos = 0;
+	while (quota) {
+		/* get the first unsent request */
+		diallock();
+		pak = pak_pop_unsent();
+		if (!pak) {
+			dialunlock();
+			break;
+		}
+		dialunlock();
+
+		/* check the process */
+		process = find_process_pid(INODE_PID(pak->ino));
+		if (!process) {
+			diallock();
+			pak_set_sent(pak);
+			pak->agent = agent;
+			dialunlock();
+			dial_received(pak->seq, 0, 0);
+			continue;
+		}
+
+		/* check the size */
+		if (agent->context)
+			process_describe(process);
+		length = agent->binary ? length_pak_record(pak, process, agent->context)
+					: length_pak(pak, process, agent->context);
+		if (agent->read_count && agent->read_count + length > agent->read_size) {
+			diallock();
+			pak_unpop_unsent(pak);
+			dialunlock();
+			break;
+		}
+		if (reserve_read_buffer(agent, agent->read_count + length) < 0) {
+			diallock();
+			pak_unpop_unsent(pak);
+			dialunlock();
+			if (!agent->read_count) {
+				fuse_reply_err(agent->read_req, ENOMEM);
+				agent->read_req = 0;
+				return;
+			}
+			break;
+		}
+
+		/* add the request to the buffer */
+		diallock();
+		pak_set_sent(pak);
+		pak->agent = agent;
+		dialunlock();
+		if (agent->binary)
+			agent->read_count += format_pak_record(agent->read_buffer + agent->read_count, pak, process, agent->context);
+		else
+			agent->read_count += format_pak(agent->read_buffer + agent->read_count, pak, process, agent->context);
+		quota--;
+	}
+
+	/* send */
+	send_read(agent);
+}
+
+/* count of free request records of the ring of the agent */
+static uint32_t ring_free_requests(struct dial_agent *agent)
+{
+	struct dial_ring *ring;
+
+	ring = &agent->ring;
+	if (!ring->header)
+		return 0;
+	return ring->request_count - (ring->header->request_head
+			- __atomic_load_n(&ring->header->request_tail, __ATOMIC_ACQUIRE));
+}
+
+/* give to the ring of the agent at most 'quota' pending requests */
+static void ring_process_pending_paks(struct dial_agent *agent, int quota)
+{
+	struct dial_ring *ring;
+	struct keyzen_ring_request *r;
+	struct process *process;
+	struct pending_access_key *pak, *skipped;
+	uint32_t head, avail;
+	const char *key;
+	char type;
+	int kid, count;
+
+	ring = &agent->ring;
+	skipped = 0;
+	head = ring->header->request_head;
+	avail = ring_free_requests(agent);
+	count = 0;
+	while (quota && avail) {
+		/* get the first unsent request */
+		diallock();
+		pak = pak_pop_unsent();
+		if (!pak) {
+			dialunlock();
+			break;
+		}
+		dialunlock();
+
+		/* check the process */
+		process = find_process_pid(INODE_PID(pak->ino));
+		if (!process) {
+			diallock();
+			pak_set_sent(pak);
+			pak->agent = agent;
+			dialunlock();
+			dial_received(pak->seq, 0, 0);
+			continue;
+		}
+
+		/* keys too long are left to readers, the others go on */
+		kid = INODE_KEY(pak->ino);
+		key = keyset_key(kid);
+		if (strlen(key) >= KEYZEN_RING_KEY_MAX) {
+			pak->next = skipped;
+			skipped = pak;
+			continue;
+		}
+
+		/* add the request to the ring */
+		diallock();
+		pak_set_sent(pak);
+		pak->agent = agent;
+		dialunlock();
+		r = &ring->requests[head & (ring->request_count - 1)];
+		r->seq = (uint32_t)pak->seq;
+		r->pid = (uint32_t)process->pid;
+		r->kid = (uint32_t)kid;
+		type = keyset_get(process->keyset, kid);
+		r->type = type ? type : CHAR_DENY;
+		strcpy(r->key, key);
+		head++;
+		avail--;
+		quota--;
+		count++;
+	}
+
+	/* put back the skipped requests, the last popped first */
+	if (skipped) {
+		diallock();
+		while (skipped) {
+			pak = skipped;
+			skipped = pak->next;
+			pak_unpop_unsent(pak);
+		}
+		dialunlock();
+	}
+
+	/* publish and signal */
+	if (count) {
+		__atomic_store_n(&ring->header->request_head, head, __ATOMIC_RELEASE);
+		if (write(ring->evreq, &(uint64_t){ count }, sizeof(uint64_t)) < 0)
+			fprintf(stderr, "keyzen-fs: can't signal ring: %m\n");
+	}
+}
+
+/* count the agents waiting in read or having room in their ring */
+static int count_waiting_agents()
+{
+	struct dial_agent *agent;
+	int waiting;
+
+	waiting = 0;
+	for (agent = agent_first ; agent ; agent = agent->next)
+		if (agent->read_req || ring_free_requests(agent))
+			waiting++;
+	return waiting;
+}
+
+/* distribute the pending requests to the waiting agents */
+static void process_pending_paks()
+{
+	struct dial_agent *agent;
+	int waiting, quota, n;
+
+	/* count the waiting agents */
+	waiting = count_waiting_agents();
+
+	/* round robin on the waiting agents, sharing the pending requests */
+	n = agent_count;
+	while (waiting && pak_unsent_count && n--) {
+		agent = agent_cursor ? agent_cursor : agent_first;
+		agent_cursor = agent->next;
+		quota = (pak_unsent_count + waiting - 1) / waiting;
+		if (agent->read_req) {
+			agent_process_pending_paks(agent, quota ? quota : 1);
+			waiting--;
+		} else if (ring_free_requests(agent)) {
+			ring_process_pending_paks(agent, quota ? quota : 1);
+			waiting--;
+		}
+	}
+}
+
+/* wake up the agents polling for pending requests */
+static void notify_polling_agents()
+{
+	struct dial_agent *agent;
+
+	for (agent = agent_first ; agent ; agent = agent->next)
+		if (agent->poll_handle) {
+			fuse_lowlevel_notify_poll(agent->poll_handle);
+			fuse_pollhandle_destroy(agent->poll_handle);
+			agent->poll_handle = 0;
+		}
+}
+
+static void dial_read(struct dial_agent *agent, fuse_req_t req, size_t size, off_t off)
+{
+	int waiting, quota;
+
+	agent->read_req = req;
+	agent->read_size = size;
+	if (!agent->nonblock)
+		process_pending_paks();
+	else {
+		/* take its share without waiting */
+		waiting = count_waiting_agents();
+		quota = (pak_unsent_count + waiting - 1) / waiting;
+		agent_process_pending_paks(agent, quota ? quota : 1);
+		if (agent->read_req) {
+			fuse_reply_err(req, EAGAIN);
+			agent->read_req = 0;
+		}
+	}
+}
+
+static void dial_poll(struct dial_agent *agent, fuse_req_t req, struct fuse_pollhandle *ph)
+{
+	unsigned revents;
+
+	if (ph) {
+		if (agent->poll_handle)
+			fuse_pollhandle_destroy(agent->poll_handle);
+		agent->poll_handle = ph;
+	}
+
+	revents = POLLOUT | POLLWRNORM;
+	if (agent->read_pos < agent->read_count || pak_unsent_count)
+		revents |= POLLIN | POLLRDNORM;
+	fuse_reply_poll(req, revents);
+}
+
+/* get a duplicate of the file descriptor 'fd' of the process of 'pidfd' */
+static int get_remote_fd(int pidfd, int fd)
+{
+#if defined(SYS_pidfd_getfd)
+	int result;
+
+	result = (int)syscall(SYS_pidfd_getfd, pidfd, fd, 0);
+	return result < 0 ? -errno : result;
+#else
+	return -ENOTSUP;
+#endif
+}
+
+static void ring_release(struct dial_agent *agent)
+{
+	struct dial_ring *ring;
+
+	ring = &agent->ring;
+	if (ring->header) {
+		munmap(ring->header, ring->size);
+		close(ring->evreq);
+		close(ring->evans);
+		ring->header = 0;
+	}
+}
+
+/* attach the ring of the memfd 'memfd' of the process 'pid' to the agent */
+static int ring_setup(struct dial_agent *agent, int pid, int memfd, int evreq, int evans)
+{
+	struct dial_ring ring;
+	struct stat st;
+	int pidfd, fd, sts, seals;
+	void *map;
+
+	if (agent->ring.header)
+		return -EBUSY;
+
+#if defined(SYS_pidfd_open)
+	pidfd = (int)syscall(SYS_pidfd_open, pid, 0);
+	if (pidfd < 0)
+		return -errno;
+#else
+	return -ENOTSUP;
+#endif
+
+	memset(&ring, 0, sizeof ring);
+	ring.evreq = ring.evans = -1;
+
+	/* map the memory */
+	fd = get_remote_fd(pidfd, memfd);
+	if (fd < 0) {
+		sts = fd;
+		goto error;
+	}
+	/* the memory must not shrink under the mapping */
+	seals = fcntl(fd, F_GET_SEALS);
+	if (seals < 0 || !(seals & F_SEAL_SHRINK)
+	 || fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof * ring.header) {
+		close(fd);
+		sts = -EINVAL;
+		goto error;
+	}
+	map = mmap(0, (size_t)st.st_size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		sts = -errno;
+		goto error;
+	}
+	ring.header = map;
+	ring.size = (size_t)st.st_size;
+
+	/* check the header */
+	ring.request_count = ring.header->request_count;
+	ring.answer_count = ring.header->answer_count;
+	if (ring.header->magic != KEYZEN_RING_MAGIC
+	 || ring.header->version != KEYZEN_RING_VERSION
+	 || !ring.request_count || (ring.request_count & (ring.request_count - 1))
+	 || !ring.answer_count || (ring.answer_count & (ring.answer_count - 1))
+	 || ring.request_count > ring.size || ring.answer_count > ring.size
+	 || KEYZEN_RING_SIZE(ring.request_count, ring.answer_count) > ring.size) {
+		sts = -EINVAL;
+		goto error;
+	}
+	ring.requests = KEYZEN_RING_REQUESTS(ring.header);
+	ring.answers = (struct keyzen_ring_answer*)(ring.requests + ring.request_count);
+
+	/* get the event fds */
+	ring.evreq = get_remote_fd(pidfd, evreq);
+	if (ring.evreq < 0) {
+		sts = ring.evreq;
+		goto error;
+	}
+	ring.evans = get_remote_fd(pidfd, evans);
+	if (ring.evans < 0) {
+		sts = ring.evans;
+		goto error;
+	}
+
+	close(pidfd);
+	agent->ring = ring;
+	return 0;
+
+error:
+	if (ring.header)
+		munmap(ring.header, ring.size);
+	if (ring.evreq >= 0)
+		close(ring.evreq);
+	close(pidfd);
+	return sts;
+}
+
+/* treat the answers of the ring of the agent */
+static void ring_receive(struct dial_agent *agent)
+{
+	struct dial_ring *ring;
+	struct keyzen_ring_answer a;
+	uint32_t tail, head;
+	uint64_t value;
+
+	ring = &agent->ring;
+	if (read(ring->evans, &value, sizeof value) < 0 && errno != EAGAIN)
+		fprintf(stderr, "keyzen-fs: can't read ring signal: %m\n");
+
+	tail = ring->header->answer_tail;
+	head = __atomic_load_n(&ring->header->answer_head, __ATOMIC_ACQUIRE);
+	if (head - tail > ring->answer_count)
+		head = tail + ring->answer_count;
+	while (tail != head) {
+		a = ring->answers[tail & (ring->answer_count - 1)];
+		tail++;
+		__atomic_store_n(&ring->header->answer_tail, tail, __ATOMIC_RELEASE);
+		if (a.seq > 0 && a.seq <= SEQ_MAX && (a.grant == 'y' || a.grant == 'n')) {
+			switch (a.type) {
+			case CHAR_DENY:		/* '-' */
+				a.type = 0;
+			case CHAR_BLANCKET:	/* '!' */
+			case CHAR_SESSION:	/* '+' */
+			case CHAR_ONE_SHOT: /* '*' */
+			case CHAR_PERMIT:	/* '=' */
+				dial_received((int)a.seq, a.grant == 'y', a.type);
+				break;
+			}
+		}
+	}
+
+	/* the agent made room in its ring */
+	process_pending_paks();
+}
+
+/* no agent came back during the grace period */
+static void dial_grace_expired(void *data)
+{
+	struct pending_access_key *pak;
+
+	for (;;) {
+		diallock();
+		pak = pak_pop_unsent();
+		if (!pak) {
+			dialunlock();
+			break;
+		}
+		pak_remove_ino(pak);
+		/*
+		the deadline may expire in the same tick: the wheel runs
+		the timers one at a time, so removing it here cancels it
+		*/
+		if (wheel_is_armed(&pak->timer))
+			wheel_remove(&pak->timer);
+		dialunlock();
+
+		dial_abandoned_count += pak_reply(pak, dial_default_grant ? 0 : EPERM);
+	}
+}
+
+static int dial_is_started()
+{
+	return agent_count > 0 || wheel_is_armed(&grace_timer);
+}
+
+static struct dial_agent *dial_start()
+{
+	struct dial_agent *agent;
+
+	agent = calloc(1, sizeof * agent);
+	if (agent) {
+		agent->write_state = writing_seq;
+		diallock();
+		agent->next = agent_first;
+		agent_first = agent;
+		agent_count++;
+		if (wheel_is_armed(&grace_timer))
+			wheel_remove(&grace_timer);
+		dialunlock();
+	}
+	return agent;
+}
+
+static void dial_stop(struct dial_agent *agent)
+{
+	struct dial_agent **prv;
+
+	assert(dial_is_started());
+
+	if (agent->read_req) {
+		fuse_reply_err(agent->read_req, EBADF);
+		agent->read_req = 0;
+	}
+
+	diallock();
+	prv = &agent_first;
+	while (*prv != agent) {
+		assert(*prv);
+		prv = &(*prv)->next;
+	}
+	*prv = agent->next;
+	if (agent_cursor == agent)
+		agent_cursor = agent->next;
+	agent_count--;
+
+	/* requeue the unanswered queries sent to the agent */
+	pak_requeue_agent(agent);
+	if (!agent_count && dial_grace)
+		wheel_add(&grace_timer, dial_grace);
+	dialunlock();
+
+	if (agent->poll_handle)
+		fuse_pollhandle_destroy(agent->poll_handle);
+	ring_release(agent);
+	free(agent->read_buffer);
+	free(agent);
+
+	/* give the requeued queries to the remaining agents */
+	if (agent_count) {
+		notify_polling_agents();
+		process_pending_paks();
+	} else if (!dial_grace)
+		dial_grace_expired(0);
+}
+
+static void query_access_key(fuse_req_t req, struct key_file *file, struct process *process, int kid)
+{
+	struct pending_access_key *pak, *prim;
+	struct pak_queue *queue;
+
+	assert(process);
+	assert(keyset_is_valid_keyid(kid));
+
+	/* check if opened dial */
+	if (!dial_is_started()) {
+		reply_access(req, file, EPERM);
+		return;
+	}
+	
+	/* enqueue the query */
 	diallock();
-	pak = pak_first_pending;
-	while (pak && pak->seq)
-		pak = pak->next;
+	if (pak_count >= PAK_MAX_PENDING) {
+		dialunlock();
+		reply_access(req, file, EAGAIN);
+		return;
+	}
+	queue = queue_get(process->pid);
+	if (!queue) {
+		dialunlock();
+		reply_access(req, file, ENOMEM);
+		return;
+	}
+	pak = pak_alloc(queue);
 	if (!pak) {
+		if (!queue->count)
+			queue_put(queue);
+		dialunlock();
+		reply_access(req, file, ENOMEM);
+		return;
+	}
+	pak->req = req;
+	pak->file = file;
+	if (file) {
+		file->pak = pak;
+		file->verdict = '?';
+	}
+	pak->ino = MK_INODE_KEY(process->pid,kid);
+
+	/* coalesce with the same query in progress */
+	prim = pak_search_ino(pak->ino);
+	if (prim) {
+		pak->same = prim->same;
+		prim->same = pak;
 		dialunlock();
 		return;
 	}
 
-	/* find the seq */
-	do {
-		last_seq = (last_seq % 999999) + 1;
-		p = pak_first_pending;
-		while (p && p->seq != last_seq)
-			p = p->next;
-	} while(p);
-	pak->seq = last_seq;
+	/* check the quota of the process */
+	if (queue->queries >= PAK_MAX_PER_PID) {
+		if (file)
+			file->pak = 0;
+		pak_free(pak);
+		dialunlock();
+		reply_access(req, file, EBUSY);
+		return;
+	}
+	queue->queries++;
+	pak->same = 0;
+	pak->mode = keyset_get(process->keyset, kid);
+	pak_add_ino(pak);
+	pak_push_unsent(pak);
+	wheel_timer_init(&pak->timer, pak_expired, pak);
+	if (dial_timeout)
+		wheel_add(&pak->timer, dial_timeout);
 	dialunlock();
 
-	/* treat now */
-	process = find_process_pid(INODE_PID(pak->ino));
-	if (!process) {
-		dial_received(pak->seq, 0, 0);
-		return;
+	/* process the pending queries */
+	notify_polling_agents();
+	process_pending_paks();
+}
+
+/* reply the recorded decision if any and returns 1, otherwise returns 0 */
+static int reply_decided(fuse_req_t req, struct key_file *file, struct process *process, uint64_t session, int kid)
+{
+	switch (decisions_get(session, process->exe_dev, process->exe_ino, kid)) {
+	case 'y':
+		reply_access(req, file, 0);
+		return 1;
+	case 'n':
+		reply_access(req, file, EPERM);
+		return 1;
+	default:
+		return 0;
 	}
+}
 
-	/* creates the buffer */
-	b = read_buffer;
-	b += _itoa(pak->seq, b);
-	*b++ = ' ';
-	str = process->name;
-	for (i = 0 ; !!(b[i] = str[i]) ; i++);
-	b += i;
-	*b++ = ' ';
-	kid = INODE_KEY(pak->ino);
-	type = keyset_get(process->keyset, kid); 
-	*b++ = type ? type : CHAR_DENY; 
-	str = keyset_key(kid); 
-	for (i = 0 ; !!(b[i] = str[i]) ; i++);
-	b += i;
-	*b++ = '\n';
-	read_count = b - read_buffer;
-	read_pos = 0;
+static void access_key(fuse_req_t req, struct key_file *file, struct process *process, int kid)
+{
+	assert(process);
+
+	if (!keyset_is_valid_keyid(kid))
+		reply_access(req, file, ENOENT);
+	else {
+		switch (keyset_get(process->keyset, kid)) {
+		case CHAR_BLANCKET:	/* '!' */
+			/* is it already decided for the application? */
+			process_identify(process);
+			if (!process->exe_ino || !reply_decided(req, file, process, DECISIONS_APPLICATION, kid))
+				query_access_key(req, file, process, kid);
+			break;
+		case CHAR_SESSION:	/* '+' */
+			/* is it already decided for the session? */
+			process_identify(process);
+			if (!process->session || !reply_decided(req, file, process, process->session, kid))
+				query_access_key(req, file, process, kid);
+			break;
+		case CHAR_ONE_SHOT: /* '*' */
+			query_access_key(req, file, process, kid);
+			break;
+		case CHAR_PERMIT:	/* '=' */
+			reply_access(req, file, 0);
+			break;
+		default:
+			reply_access(req, file, EPERM);
+			break;
+		}
+	}
+}
+
+/* execute the control line of the agent */
+static int dial_command(struct dial_agent *agent, fuse_req_t req, const char *command)
+{
+	int memfd, evreq, evans, version, n;
+
+	if (sscanf(command, "ring %d %d %d%n", &memfd, &evreq, &evans, &n) == 3 && !command[n]) {
+		n = ring_setup(agent, (int)fuse_req_ctx(req)->pid, memfd, evreq, evans);
+		if (!n)
+			process_pending_paks();
+		return n;
+	}
+	if (sscanf(command, "context %d%n", &version, &n) == 1 && !command[n]) {
+		if (version < 0 || version > KEYZEN_CONTEXT_VERSION)
+			return -EPROTONOSUPPORT;
+		agent->context = version;
+		return 0;
+	}
+	if (sscanf(command, "binary %d%n", &version, &n) == 1 && !command[n]) {
+		if (version != KEYZEN_BINARY_VERSION)
+			return -EPROTONOSUPPORT;
+		agent->binary = 1;
+		agent->record_length = 0;
+		agent->record_skip = 0;
+		return 0;
+	}
+	return -EINVAL;
+}
+
+/* parse the text lines written by the agent until it switches to binary */
+static size_t dial_write_text(struct dial_agent *agent, fuse_req_t req, const char *buf, size_t count, int *sts)
+{
+	size_t pos;
+	int state, seq, rc;
+	char grant, type, c;
+
+	state = agent->write_state;
+	seq = agent->write_seq;
+	grant = agent->write_grant;
+	type = agent->write_type;
+	pos = 0;
+	while (pos < count && !agent->binary) {
+		c = buf[pos++];
+		switch (state) {
+
+		case writing_seq:
+			if ('0' <= c && c <= '9')
+				seq = 10 * seq + (int)(c - '0');
+			else if ('a' <= c && c <= 'z' && !seq) {
+				agent->command[0] = c;
+				agent->command_length = 1;
+				state = writing_command;
+			} else if (c != ' ' || !seq)
+				state = writing_error;
+			else
+				state = writing_grant;
+			break;
+
+		case writing_grant:
+			if (c == 'n') {
+				grant = 0;
+				state = writing_type;
+			} else if (c == 'y') {
+				grant = 1;
+				state = writing_type;
+			} else
+				state = writing_error;
+			break;
+
+		case writing_type:
+			switch (c) {
+			case CHAR_DENY:		/* '-' */
+				c = 0;
+			case CHAR_BLANCKET:	/* '!' */
+			case CHAR_SESSION:	/* '+' */
+			case CHAR_ONE_SHOT: /* '*' */
+			case CHAR_PERMIT:	/* '=' */
+				type = c;
+				state = writing_eol;
+				break;
+			default:
+				state = writing_error;
+				break;
+			}
+			break;
+
+		case writing_eol:
+			if (c != '\n') {
+				state = writing_error;
+			} else {
+				dial_received(seq, grant, type);
+				seq = 0;
+				grant = 0;
+				type = 0;
+				state = writing_seq;
+			}
+			break;
+			
+		case writing_command:
+			if (c != '\n') {
+				if (agent->command_length < COMMAND_MAX - 1)
+					agent->command[agent->command_length++] = c;
+				else
+					state = writing_error;
+			} else {
+				agent->command[agent->command_length] = 0;
+				rc = dial_command(agent, req, agent->command);
+				if (rc)
+					*sts = rc;
+				state = writing_seq;
+			}
+			break;
+
+		case writing_error:
+			seq = 0;
+			grant = 0;
+			type = 0;
+			if (c == '\n')
+				state = writing_seq;
+			break;
+		}
+	}
+	agent->write_state = state;
+	agent->write_seq = seq;
+	agent->write_grant = grant;
+	agent->write_type = type;
+
+	return pos;
+}
+
+/* treat the binary record received from the agent */
+static int dial_record(struct dial_agent *agent, fuse_req_t req)
+{
+	struct keyzen_answer_record *a;
+	size_t length;
+	char type;
+
+	switch (agent->record.head.kind) {
+	case KEYZEN_RECORD_ANSWER:
+		a = &agent->record.answer;
+		if (agent->record.head.length < sizeof * a || !a->seq || a->seq > SEQ_MAX)
+			return -EINVAL;
+		switch (a->type) {
+		case CHAR_DENY:		/* '-' */
+			type = 0;
+			break;
+		case CHAR_BLANCKET:	/* '!' */
+		case CHAR_SESSION:	/* '+' */
+		case CHAR_ONE_SHOT: /* '*' */
+		case CHAR_PERMIT:	/* '=' */
+			type = a->type;
+			break;
+		default:
+			return -EINVAL;
+		}
+		if (a->grant != 'y' && a->grant != 'n')
+			return -EINVAL;
+		dial_received((int)a->seq, a->grant == 'y', type);
+		return 0;
+
+	case KEYZEN_RECORD_CONTROL:
+		length = agent->record.head.length - sizeof agent->record.head;
+		memcpy(agent->command, &agent->record.head + 1, length);
+		while (length && !agent->command[length - 1])
+			length--;
+		if (length >= sizeof agent->command)
+			return -EINVAL; /* no room for the terminating zero */
+		agent->command[length] = 0;
+		return dial_command(agent, req, agent->command);
+
+	default:
+		/* unknown records are skipped */
+		return 0;
+	}
+}
+
+/* parse the binary records written by the agent */
+static void dial_write_binary(struct dial_agent *agent, fuse_req_t req, const char *buf, size_t count, int *sts)
+{
+	size_t pos, need, n;
+	int rc;
+
+	pos = 0;
+	while (pos < count) {
+		/* skip the records too long */
+		if (agent->record_skip) {
+			n = count - pos;
+			if (n > agent->record_skip)
+				n = agent->record_skip;
+			agent->record_skip -= n;
+			pos += n;
+			continue;
+		}
+
+		/* get the head, then the record */
+		need = agent->record_length < sizeof agent->record.head
+				? sizeof agent->record.head : agent->record.head.length;
+		n = need - agent->record_length;
+		if (n > count - pos)
+			n = count - pos;
+		memcpy(agent->record.data + agent->record_length, buf + pos, n);
+		agent->record_length += n;
+		pos += n;
+		if (agent->record_length < need)
+			break;
+
+		/* check the head */
+		if (need == sizeof agent->record.head) {
+			need = agent->record.head.length;
+			if (need < sizeof agent->record.head || (need & 3)) {
+				/* lost framing */
+				*sts = -EPROTO;
+				agent->record_length = 0;
+				break;
+			}
+			if (need > sizeof agent->record) {
+				agent->record_skip = need - agent->record_length;
+				agent->record_length = 0;
+				if (agent->record.head.kind == KEYZEN_RECORD_ANSWER
+				 || agent->record.head.kind == KEYZEN_RECORD_CONTROL)
+					*sts = -EINVAL;
+				continue;
+			}
+			if (need > agent->record_length)
+				continue;
+		}
+
+		/* the record is complete */
+		rc = dial_record(agent, req);
+		if (rc)
+			*sts = rc;
+		agent->record_length = 0;
+	}
+}
+
+static void dial_write(struct dial_agent *agent, fuse_req_t req, const char *buf, size_t count, off_t off)
+{
+	size_t pos;
+	int sts;
+
+	sts = 0;
+	pos = agent->binary ? 0 : dial_write_text(agent, req, buf, count, &sts);
+	if (pos < count)
+		dial_write_binary(agent, req, buf + pos, count - pos, &sts);
+
+	if (sts)
+		fuse_reply_err(req, -sts);
+	else
+		fuse_reply_write(req, count);
+}
+
+/*====================================================*/
+/*===================== KEY FILES ====================*/
+/*====================================================*/
+
+/*
+reading a key file gives the verdict of the key at the time of
+the open: 'Y' when granted, 'N' when denied and, for files opened
+with O_NONBLOCK, '?' while the agent is deciding. reads without
+O_NONBLOCK are waiting the verdict. the file is pollable for the
+verdict.
+*/
+
+static struct key_file *key_file_open(struct process *process, int kid, int nonblock)
+{
+	struct key_file *file;
+
+	file = malloc(sizeof * file);
+	if (file) {
+		file->pak = 0;
+		file->query = 0;
+		file->read_req = 0;
+		file->poll_handle = 0;
+		file->nonblock = nonblock;
+		file->error = 0;
+		file->verdict = '?';
+		access_key(0, file, process, kid);
+	}
+	return file;
+}
+
+static void key_file_read(struct key_file *file, fuse_req_t req)
+{
+	if (!file->pak) {
+		if (file->error)
+			fuse_reply_err(req, file->error);
+		else
+			fuse_reply_buf(req, &file->verdict, 1);
+	} else if (file->nonblock)
+		fuse_reply_buf(req, &file->verdict, 1);
+	else if (file->read_req)
+		fuse_reply_err(req, EBUSY);
+	else
+		file->read_req = req;
+}
+
+static void key_file_poll(struct key_file *file, fuse_req_t req, struct fuse_pollhandle *ph)
+{
+	if (ph) {
+		if (file->poll_handle)
+			fuse_pollhandle_destroy(file->poll_handle);
+		file->poll_handle = file->pak ? ph : 0;
+		if (!file->pak)
+			fuse_pollhandle_destroy(ph);
+	}
+	fuse_reply_poll(req, file->pak ? 0 : POLLIN | POLLRDNORM);
+}
+
+static void key_file_release(struct key_file *file)
+{
+	/* the query continues without the file */
+	if (file->pak)
+		file->pak->file = 0;
+	if (file->read_req)
+		fuse_reply_err(file->read_req, EBADF);
+	if (file->poll_handle)
+		fuse_pollhandle_destroy(file->poll_handle);
+	free(file);
+}
+
+
+/*====================================================*/
+/*===================== QUERY FILES ==================*/
+/*====================================================*/
+
+/*
+the query file of a process checks many keys at once. each line
+written is a key whose check starts immediately. reading gives a
+verdict per key written since the previous complete read, in the
+order of writing: 'Y' when granted, 'N' when denied, 'X' when not a
+key of the process, 'E' when the query failed and, for files opened
+with O_NONBLOCK, '?' while the agent is deciding. reads without
+O_NONBLOCK are waiting all the verdicts. the file is pollable for
+the verdicts. after an empty line, the keys written once a key of
+the query is known as failed are not checked and get 'S' (skipped).
+*/
+
+static struct query_file *query_file_open(struct process *process, int nonblock)
+{
+	struct query_file *query;
+
+	query = malloc(sizeof * query);
+	if (query) {
+		query->keys = 0;
+		query->count = 0;
+		query->alloc = 0;
+		query->pending = 0;
+		query->failfast = 0;
+		query->failed = 0;
+		query->pid = process->pid;
+		query->read_req = 0;
+		query->poll_handle = 0;
+		query->nonblock = nonblock;
+		query->length = 0;
+	}
+	return query;
+}
+
+/* add the 'key' to the query and start its check */
+static int query_file_add(struct query_file *query, struct process *process, const char *key)
+{
+	struct key_file *file, **keys;
+	int kid;
+
+	if (query->count >= KEYZEN_QUERY_MAX)
+		return -E2BIG;
+
+	if (query->count == query->alloc) {
+		keys = realloc(query->keys, (size_t)(query->alloc + 16) * sizeof * keys);
+		if (!keys)
+			return -ENOMEM;
+		query->keys = keys;
+		query->alloc += 16;
+	}
+
+	file = malloc(sizeof * file);
+	if (!file)
+		return -ENOMEM;
+	file->pak = 0;
+	file->query = query;
+	file->read_req = 0;
+	file->poll_handle = 0;
+	file->nonblock = 1;
+	file->error = 0;
+	file->verdict = '?';
+	query->keys[query->count++] = file;
+	query->pending++;
+
+	if (query->failfast && query->failed) {
+		key_file_decided(file, ECANCELED);
+		return 0;
+	}
+
+	lock();
+	kid = process_keys_may_have(process, key);
+	unlock();
+	if (kid < 0)
+		key_file_decided(file, ENOENT);
+	else
+		access_key(0, file, process, kid);
+	return 0;
+}
+
+static void query_file_write(struct query_file *query, fuse_req_t req, const char *buf, size_t count)
+{
+	struct process *process;
+	size_t pos;
+	int sts;
+
+	process = find_process_pid(query->pid);
+	if (!process) {
+		fuse_reply_err(req, ENOENT);
+		return;
+	}
+
+	sts = 0;
+	for (pos = 0 ; !sts && pos < count ; pos++) {
+		if (buf[pos] != '\n') {
+			if (query->length < NAME_MAX)
+				query->line[query->length++] = buf[pos];
+			else
+				sts = -ENAMETOOLONG;
+		} else if (query->length) {
+			query->line[query->length] = 0;
+			query->length = 0;
+			sts = query_file_add(query, process, query->line);
+		} else
+			query->failfast = 1;
+	}
+
+	if (sts)
+		fuse_reply_err(req, -sts);
+	else
+		fuse_reply_write(req, count);
+}
+
+static void query_file_read(struct query_file *query, fuse_req_t req, size_t size)
+{
+	if (!query->pending || query->nonblock)
+		query_file_send(query, req, size);
+	else if (query->read_req)
+		fuse_reply_err(req, EBUSY);
+	else {
+		query->read_req = req;
+		query->read_size = size;
+	}
+}
+
+static void query_file_poll(struct query_file *query, fuse_req_t req, struct fuse_pollhandle *ph)
+{
+	if (ph) {
+		if (query->poll_handle)
+			fuse_pollhandle_destroy(query->poll_handle);
+		query->poll_handle = query->pending ? ph : 0;
+		if (!query->pending)
+			fuse_pollhandle_destroy(ph);
+	}
+	fuse_reply_poll(req, query->pending ? POLLOUT | POLLWRNORM : POLLIN | POLLRDNORM | POLLOUT | POLLWRNORM);
+}
+
+static void query_file_release(struct query_file *query)
+{
+	query_file_reset(query);
+	if (query->read_req)
+		fuse_reply_err(query->read_req, EBADF);
+	if (query->poll_handle)
+		fuse_pollhandle_destroy(query->poll_handle);
+	free(query->keys);
+	free(query);
+}
+
+
+/*====================================================*/
+/*===================== UPDATE FILES =================*/
+/*====================================================*/
+
+/*
+the update file of a process changes its keys by transactions. the
+lines written are:
+
+   "a" sp key lf      adds the key, that can be prefixed by its mode
+   "d" sp key lf      drops the key
+   "s" [sp key] lf    as "a" but the keys not added are dropped
+   lf                 applies the lines written since the previous one
+
+the keys already set are not changed by "a" and "s". the lines of a
+transaction are all applied under one lock or none is applied. on
+error, the lines not applied are discarded.
+*/
+
+#define UPDATE_MAX			65536	/* maximum length of a transaction */
+
+struct update_file {
+	int pid;							/* pid of the process */
+	size_t length;						/* length of the pending lines */
+	size_t alloc;						/* allocated length of the lines */
+	char *lines;						/* the pending lines */
+};
+
+struct update_item {
+	int kid;							/* the key or -1 if not existing */
+	char op;							/* 'a', 'd' or 's' */
+	char value;							/* the mode of the added key */
+	const char *key;					/* the name of the key */
+};
+
+struct update_set {
+	struct process *process;
+	int *keep;							/* sorted keys to keep */
+	int count;							/* count of keys to keep */
+};
+
+static int compare_kid(const void *a, const void *b)
+{
+	return *(const int*)a - *(const int*)b;
+}
+
+/* drops the key 'kid' if not kept by the set 'extra' */
+static void update_set_drop(const char *key, int kid, char type, void *extra)
+{
+	struct update_set *set = extra;
+
+	if (!bsearch(&kid, set->keep, (size_t)set->count, sizeof * set->keep, compare_kid)) {
+		process_set_mode(set->process, kid, 0);
+		events_printf("drop %d %s\n", set->process->pid, key);
+	}
+}
+
+/* apply the 'count' lines of 'text' to 'process' for the requester 'pid' */
+static int update_apply(struct process *process, int pid, char *text, int count)
+{
+	struct update_item *items;
+	struct update_set set;
+	const char *key;
+	int i, n, changes, sts;
+
+	items = malloc((size_t)count * (sizeof * items + sizeof * set.keep));
+	if (!items)
+		return -ENOMEM;
+	set.process = process;
+	set.keep = (int*)(items + count);
+	set.count = -1;
+
+	sts = 0;
+	changes = 0;
+	lock();
+#if !NOSECURITY
+	if (process->pid != pid)
+		sts = -EPERM;
+#endif
+
+	/* get the existing keys, the others are created once permitted */
+	for (i = n = 0 ; !sts && i < count ; i++, text += strlen(text) + 1) {
+		items[i].op = text[0];
+		items[i].kid = -1;
+		items[i].value = 0;
+		if (text[1] && (text[1] != ' ' || !text[2])) {
+			sts = -EINVAL;
+			break;
+		}
+		key = text[1] ? text + 2 : 0;
+		switch (text[0]) {
+		case 's':
+			if (set.count < 0)
+				set.count = 0;
+			if (!key)
+				break;
+			/* fall through */
+		case 'a':
+			if (!key) {
+				sts = -EINVAL;
+				break;
+			}
+			items[i].value = key_mode(&key);
+			items[i].key = key;
+			items[i].kid = keyset_keyid(key, 0);
+			if (items[i].kid >= 0)
+				set.keep[n++] = items[i].kid;
+			if (items[i].value && (items[i].kid < 0
+			 || keyset_get(process->keyset, items[i].kid) != items[i].value))
+				changes++;
+			break;
+		case 'd':
+			if (!key) {
+				sts = -EINVAL;
+				break;
+			}
+			key_mode(&key);
+			items[i].kid = keyset_keyid(key, 0);
+			break;
+		default:
+			sts = -EINVAL;
+			break;
+		}
+	}
+	/* adding keys or changing their modes is for admins */
+	if (!sts && changes && !process_is_admin(process))
+		sts = -EPERM;
+
+	/* create the new keys */
+	for (i = 0 ; !sts && i < count ; i++) {
+		if (items[i].op != 'd' && items[i].value && items[i].kid < 0) {
+			items[i].kid = keyset_keyid(items[i].key, 1);
+			if (items[i].kid < 0)
+				sts = items[i].kid;
+			else
+				set.keep[n++] = items[i].kid;
+		}
+	}
+
+	/* apply the transaction */
+	if (!sts) {
+		if (set.count == 0) {
+			set.count = n;
+			qsort(set.keep, (size_t)n, sizeof * set.keep, compare_kid);
+			keyset_for_all_not_null(process->keyset, update_set_drop, &set);
+		}
+		for (i = 0 ; i < count ; i++) {
+			if (items[i].kid < 0)
+				continue;
+			if (items[i].op == 'd') {
+				if (keyset_get(process->keyset, items[i].kid)) {
+					process_set_mode(process, items[i].kid, 0);
+					events_printf("drop %d %s\n", process->pid, keyset_key(items[i].kid));
+				}
+			} else if (items[i].value && keyset_get(process->keyset, items[i].kid) != items[i].value) {
+				process_set_mode(process, items[i].kid, items[i].value);
+				events_printf("set %d %c%s\n", process->pid, items[i].value, keyset_key(items[i].kid));
+			}
+		}
+	}
+	unlock();
+
+	free(items);
+	return sts;
+}
+
+static struct update_file *update_file_open(struct process *process)
+{
+	struct update_file *update;
+
+	update = malloc(sizeof * update);
+	if (update) {
+		update->pid = process->pid;
+		update->length = 0;
+		update->alloc = 0;
+		update->lines = 0;
+	}
+	return update;
+}
+
+static void update_file_write(struct update_file *update, fuse_req_t req, const char *buf, size_t count)
+{
+	struct process *process;
+	size_t pos, start;
+	char *lines;
+	int sts, n;
+
+	/* append the lines */
+	if (update->length + count > update->alloc) {
+		if (update->length + count > UPDATE_MAX) {
+			update->length = 0;
+			fuse_reply_err(req, E2BIG);
+			return;
+		}
+		lines = realloc(update->lines, update->length + count);
+		if (!lines) {
+			fuse_reply_err(req, ENOMEM);
+			return;
+		}
+		update->lines = lines;
+		update->alloc = update->length + count;
+	}
+	memcpy(update->lines + update->length, buf, count);
+	update->length += count;
+
+	/* apply the complete transactions */
+	sts = 0;
+	n = 0;
+	start = 0;
+	for (pos = 0 ; !sts && pos < update->length ; pos++) {
+		if (update->lines[pos] != '\n')
+			continue;
+		update->lines[pos] = 0;
+		if (pos != start && update->lines[pos - 1]) {
+			/* end of a line */
+			n++;
+		} else {
+			/* end of a transaction */
+			if (n) {
+				process = find_process_pid(update->pid);
+				sts = process ? update_apply(process, (int)fuse_req_ctx(req)->pid, update->lines + start, n) : -ENOENT;
+			}
+			start = pos + 1;
+			n = 0;
+		}
+	}
+
+	if (sts)
+		update->length = 0;
+	else {
+		update->length -= start;
+		memmove(update->lines, update->lines + start, update->length);
+		/* restore the ends of the pending lines */
+		for (pos = 0 ; pos < update->length ; pos++)
+			if (!update->lines[pos])
+				update->lines[pos] = '\n';
+	}
 
-	/* send */
-	send_read();
+	if (sts)
+		fuse_reply_err(req, -sts);
+	else
+		fuse_reply_write(req, count);
 }
 
-static void dial_read(fuse_req_t req, size_t size, off_t off)
+static void update_file_release(struct update_file *update)
 {
-	read_req = req;
-	read_size = size;
-	process_pending_paks();
+	free(update->lines);
+	free(update);
 }
 
-static void query_access_key(fuse_req_t req, struct process *process, int kid)
-{
-	struct pending_access_key *pak;
 
-	assert(process);
-	assert(keyset_is_valid_keyid(kid));
+/*====================================================*/
+/*===================== LIST FILES ===================*/
+/*====================================================*/
 
-	/* check if opened dial */
-	if (!dial_is_started()) {
-		fuse_reply_err(req, EPERM);
-		return;
-	}
-	
-	/* enqueue the query */
-	diallock();
-	pak = pak_first_free;
-	if (pak)
-		pak_first_free = pak->next;
-	else {
-		dialunlock();
-		pak = malloc(sizeof * pak);
-		if (!pak) {
-			fuse_reply_err(req, ENOMEM);
-			return;
-		}
-		diallock();
-	}
-	pak->req = req;
-	pak->ino = MK_INODE_KEY(process->pid,kid);
-	pak->seq = 0;
-	pak->next = 0;
+/*
+the list file of a process gives the keys of the process at the
+time of the open in the format of the lists of libkeyzen: the int
+count of keys, the int offsets of the keys from the start and the
+zero terminated keys, sorted.
+*/
 
-	if (pak_last_pending)
-		pak_last_pending->next = pak;
-	else
-		pak_first_pending = pak;
-	pak_last_pending = pak;
-	dialunlock();
+struct list_file {
+	size_t size;						/* size of the data */
+	char data[1];						/* the list */
+};
 
-	/* process the pending queries */
-	process_pending_paks();
-}
+struct list_keys {
+	const char **keys;					/* the keys */
+	int count;							/* count of keys */
+	int alloc;							/* allocated count of keys */
+	size_t length;						/* length of the keys */
+	int error;
+};
 
-static void access_key(fuse_req_t req, struct process *process, int kid)
+static void list_add_key(const char *key, int kid, char type, void *extra)
 {
-	assert(process);
+	struct list_keys *list = extra;
+	const char **keys;
 
-	if (!keyset_is_valid_keyid(kid))
-		fuse_reply_err(req, ENOENT);
-	else {
-		switch (keyset_get(process->keyset, kid)) {
-		case CHAR_BLANCKET:	/* '!' */
-		case CHAR_SESSION:	/* '+' */
-		case CHAR_ONE_SHOT: /* '*' */
-			query_access_key(req, process, kid);
-			break;
-		case CHAR_PERMIT:	/* '=' */
-			fuse_reply_err(req, 0);
-			break;
-		default:
-			fuse_reply_err(req, EPERM);
-			break;
+	if (list->error)
+		return;
+	if (list->count == list->alloc) {
+		keys = realloc(list->keys, (size_t)(list->alloc + 64) * sizeof * keys);
+		if (!keys) {
+			list->error = -ENOMEM;
+			return;
 		}
+		list->keys = keys;
+		list->alloc += 64;
 	}
+	list->keys[list->count++] = key;
+	list->length += strlen(key) + 1;
 }
 
-static void dial_write(fuse_req_t req, const char *buf, size_t count, off_t off)
+static int compare_keys(const void *a, const void *b)
 {
-	size_t pos;
-	int state, seq;
-	char grant, type, c;
-
-	state = write_state;
-	seq = write_seq;
-	grant = write_grant;
-	type = write_type;
-	pos = 0;
-	while (pos < count) {
-		c = buf[pos++];
-		switch (state) {
-
-		case writing_seq:
-			if ('0' <= c && c <= '9')
-				seq = 10 * seq + (int)(c - '0');
-			else if (c != ' ' || !seq)
-				state = writing_error;
-			else
-				state = writing_grant;
-			break;
+	return strcmp(*(const char **)a, *(const char **)b);
+}
 
-		case writing_grant:
-			if (c == 'n') {
-				grant = 0;
-				state = writing_type;
-			} else if (c == 'y') {
-				grant = 1;
-				state = writing_type;
-			} else
-				state = writing_error;
-			break;
+static struct list_file *list_file_open(struct process *process)
+{
+	struct list_file *file;
+	struct list_keys list;
+	int i, *offsets;
+	size_t pos;
 
-		case writing_type:
-			switch (c) {
-			case CHAR_DENY:		/* '-' */
-				c = 0;
-			case CHAR_BLANCKET:	/* '!' */
-			case CHAR_SESSION:	/* '+' */
-			case CHAR_ONE_SHOT: /* '*' */
-			case CHAR_PERMIT:	/* '=' */
-				type = c;
-				state = writing_eol;
-				break;
-			default:
-				state = writing_error;
-				break;
-			}
-			break;
+	list.keys = 0;
+	list.count = 0;
+	list.alloc = 0;
+	list.length = 0;
+	list.error = 0;
+	lock();
+	keyset_for_all_not_null(process->keyset, list_add_key, &list);
+	unlock();
 
-		case writing_eol:
-			if (c != '\n') {
-				state = writing_error;
-			} else {
-				dial_received(seq, grant, type);
-				seq = 0;
-				grant = 0;
-				type = 0;
-				state = writing_seq;
+	file = 0;
+	if (!list.error) {
+		qsort(list.keys, (size_t)list.count, sizeof * list.keys, compare_keys);
+		pos = (size_t)(list.count + 1) * sizeof(int);
+		file = malloc(sizeof * file + pos + list.length);
+		if (file) {
+			offsets = (int*)file->data;
+			offsets[0] = list.count;
+			for (i = 0 ; i < list.count ; i++) {
+				offsets[i + 1] = (int)pos;
+				pos = (size_t)(stpcpy(file->data + pos, list.keys[i]) + 1 - file->data);
 			}
-			break;
-			
-		case writing_error:
-			seq = 0;
-			grant = 0;
-			type = 0;
-			if (c == '\n')
-				state = writing_seq;
-			break;
+			file->size = pos;
 		}
 	}
-	write_state = state;
-	write_seq = seq;
-	write_grant = grant;
-	write_type = type;
+	free(list.keys);
+	return file;
+}
+
+static void list_file_read(struct list_file *file, fuse_req_t req, size_t size, off_t off)
+{
+	if (off >= (off_t)file->size)
+		fuse_reply_buf(req, NULL, 0);
+	else {
+		if (size > file->size - (size_t)off)
+			size = file->size - (size_t)off;
+		fuse_reply_buf(req, file->data + off, size);
+	}
+}
 
-	fuse_reply_write(req, count);
+static void list_file_release(struct list_file *file)
+{
+	free(file);
 }
 
 
@@ -943,6 +3858,12 @@ static int fill_dirbuf_content(int fdbuf, fuse_ino_t ino, pid_t pid)
 		if (sts)
 			return sts;
 
+		/* add events file */
+		stat_events(&stbuf);
+		sts = fdbuf_add(fdbuf, KEYZEN_EVENTS_NAME, &stbuf);
+		if (sts)
+			return sts;
+
 		/* at root directory */
 		process = first;
 		while (process) {
@@ -1055,6 +3976,9 @@ static void keyzen_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
 		} else if (!strcmp(name, KEYZEN_DIAL_NAME)) {
 			stat_dial(&e.attr);
 
+		} else if (!strcmp(name, KEYZEN_EVENTS_NAME)) {
+			stat_events(&e.attr);
+
 		} else {
 			process = find_process_name(name);
 			if (process) {
@@ -1073,6 +3997,9 @@ static void keyzen_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
 		} else if (!strcmp(name, ".")) {
 			stat_process(&e.attr, process);
 
+		} else if (ctl_of_name(name)) {
+			stat_ctl(&e.attr, process, ctl_of_name(name));
+
 		} else {
 			lock();
 			kid = process_keys_may_have(process, name);
@@ -1115,6 +4042,8 @@ static void keyzen_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info
 		stat_self(&stbuf, fuse_req_ctx(req)->pid);
 	else if (ino == INODE_DIAL)
 		stat_dial(&stbuf);
+	else if (ino == INODE_EVENTS)
+		stat_events(&stbuf);
 	else if (IS_INODE_DIR(ino)) {
 		process = find_process_pid(INODE_PID(ino));
 		if (process)
@@ -1127,6 +4056,12 @@ static void keyzen_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info
 			stat_key(&stbuf, process, INODE_KEY(ino));
 		else
 			sts = ENOENT;
+	} else if (IS_INODE_CTL(ino)) {
+		process = find_process_pid(INODE_PID(ino));
+		if (process)
+			stat_ctl(&stbuf, process, INODE_CTL(ino));
+		else
+			sts = ENOENT;
 	} else
 		sts = ENOENT;
 
@@ -1150,6 +4085,8 @@ static void keyzen_access(fuse_req_t req, fuse_ino_t ino, int mask)
 		sts = CHECK(F_OK|R_OK);
 	else if (ino == INODE_DIAL)
 		sts = CHECK(F_OK|R_OK|W_OK);/*TODO restrict usage?*/
+	else if (ino == INODE_EVENTS)
+		sts = CHECK(F_OK|R_OK);
 	else if (IS_INODE_DIR(ino)) {
 		process = find_process_pid(INODE_PID(ino));
 		if (process)
@@ -1159,11 +4096,21 @@ static void keyzen_access(fuse_req_t req, fuse_ino_t ino, int mask)
 	} else if (IS_INODE_KEY(ino)) {
 		process = find_process_pid(INODE_PID(ino));
 		if (process) {
-			access_key(req, process, INODE_KEY(ino));
+			access_key(req, 0, process, INODE_KEY(ino));
 			return;
 		}
 		else
 			sts = ENOENT;
+	} else if (IS_INODE_CTL(ino)) {
+		process = find_process_pid(INODE_PID(ino));
+		if (!process)
+			sts = ENOENT;
+		else if (INODE_CTL(ino) == CTL_LIST)
+			sts = CHECK(F_OK|R_OK);
+		else if (INODE_CTL(ino) == CTL_UPDATE)
+			sts = CHECK(F_OK|W_OK);
+		else
+			sts = CHECK(F_OK|R_OK|W_OK);
 	} else
 		sts = ENOENT;
 #undef CHECK
@@ -1214,6 +4161,8 @@ static void keyzen_mknod(fuse_req_t req, fuse_ino_t parent, const char *name, mo
 		fuse_reply_err(req, EPERM);
 	} else if (!S_ISREG(mode)) {
 		fuse_reply_err(req, EPERM);
+	} else if (ctl_of_name(name)) {
+		fuse_reply_err(req, EEXIST);
 	} else {
 		process = find_process_pid(INODE_PID(parent));
 		if (!process) {
@@ -1239,10 +4188,55 @@ static void keyzen_mknod(fuse_req_t req, fuse_ino_t parent, const char *name, mo
 	}
 }
 
-static void keyzen_getxattr(fuse_req_t req, fuse_ino_t ino, const char *name, size_t size)
+static void reply_xattr_string(fuse_req_t req, const char *value, size_t size)
 {
-	(void)name;
+	size_t length;
+
+	length = strlen(value);
 	if (size == 0)
+		fuse_reply_xattr(req, length);
+	else if (size < length)
+		fuse_reply_err(req, ERANGE);
+	else
+		fuse_reply_buf(req, value, length);
+}
+
+static void keyzen_getxattr(fuse_req_t req, fuse_ino_t ino, const char *name, size_t size)
+{
+	char buffer[30];
+	struct process *process;
+
+	if (IS_INODE_DIR(ino) && !strcmp(name, KEYZEN_XATTR_GENERATION)) {
+		process = find_process_pid(INODE_PID(ino));
+		if (!process)
+			fuse_reply_err(req, ENOENT);
+		else {
+			sprintf(buffer, "%lu", process->generation);
+			reply_xattr_string(req, buffer, size);
+		}
+	} else if (IS_INODE_KEY(ino) && !strcmp(name, KEYZEN_XATTR_MODE)) {
+		process = find_process_pid(INODE_PID(ino));
+		if (!process || !keyset_is_valid_keyid(INODE_KEY(ino)))
+			fuse_reply_err(req, ENOENT);
+		else {
+			buffer[0] = keyset_get(process->keyset, INODE_KEY(ino));
+			if (!buffer[0])
+				buffer[0] = CHAR_DENY;
+			buffer[1] = 0;
+			reply_xattr_string(req, buffer, size);
+		}
+	} else if (ino == INODE_ROOT && !strcmp(name, KEYZEN_XATTR_SNAPSHOT)) {
+		if (snapshot_is_on())
+			reply_xattr_string(req, snapshot_path, size);
+		else
+			fuse_reply_err(req, ENODATA);
+	} else if (ino == INODE_DIAL && !strcmp(name, KEYZEN_XATTR_TIMEDOUT)) {
+		sprintf(buffer, "%lu", dial_timedout_count);
+		reply_xattr_string(req, buffer, size);
+	} else if (ino == INODE_DIAL && !strcmp(name, KEYZEN_XATTR_ABANDONED)) {
+		sprintf(buffer, "%lu", dial_abandoned_count);
+		reply_xattr_string(req, buffer, size);
+	} else if (size == 0)
 		fuse_reply_xattr(req, 1);
 	else
 		fuse_reply_buf(req, "*", 1);
@@ -1250,42 +4244,206 @@ static void keyzen_getxattr(fuse_req_t req, fuse_ino_t ino, const char *name, si
 
 static void keyzen_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
 {
+	struct dial_agent *agent;
+	struct key_file *file;
+	struct query_file *query;
+	struct update_file *update;
+	struct list_file *list;
+	struct events_reader *reader;
+	struct process *process;
 	int sts;
 
-	if (ino != INODE_DIAL || dial_is_started() || (fi->flags & O_ACCMODE) != O_RDWR)
+	if (IS_INODE_KEY(ino)) {
+		/* key files are opened for getting the verdict */
+		sts = update_processes(0);
+		process = sts ? 0 : find_process_pid(INODE_PID(ino));
+		if (sts)
+			fuse_reply_err(req, -sts);
+		else if (!process || !keyset_is_valid_keyid(INODE_KEY(ino)))
+			fuse_reply_err(req, ENOENT);
+		else if ((fi->flags & O_ACCMODE) != O_RDONLY)
+			fuse_reply_err(req, EACCES);
+		else {
+			file = key_file_open(process, INODE_KEY(ino), !!(fi->flags & O_NONBLOCK));
+			if (!file)
+				fuse_reply_err(req, ENOMEM);
+			else {
+				fi->fh = (uint64_t)(intptr_t)file;
+				fi->direct_io = 1;
+				fi->nonseekable = 1;
+				if (fuse_reply_open(req, fi))
+					key_file_release(file);
+			}
+		}
+	} else if (IS_INODE_CTL(ino) && INODE_CTL(ino) == CTL_QUERY) {
+		/* query files are opened for checking keys */
+		sts = update_processes(0);
+		process = sts ? 0 : find_process_pid(INODE_PID(ino));
+		if (sts)
+			fuse_reply_err(req, -sts);
+		else if (!process)
+			fuse_reply_err(req, ENOENT);
+		else if ((fi->flags & O_ACCMODE) != O_RDWR)
+			fuse_reply_err(req, EACCES);
+		else {
+			query = query_file_open(process, !!(fi->flags & O_NONBLOCK));
+			if (!query)
+				fuse_reply_err(req, ENOMEM);
+			else {
+				fi->fh = (uint64_t)(intptr_t)query;
+				fi->direct_io = 1;
+				fi->nonseekable = 1;
+				if (fuse_reply_open(req, fi))
+					query_file_release(query);
+			}
+		}
+	} else if (IS_INODE_CTL(ino) && INODE_CTL(ino) == CTL_UPDATE) {
+		/* update files are opened for changing keys */
+		sts = update_processes(0);
+		process = sts ? 0 : find_process_pid(INODE_PID(ino));
+		if (sts)
+			fuse_reply_err(req, -sts);
+		else if (!process)
+			fuse_reply_err(req, ENOENT);
+		else if ((fi->flags & O_ACCMODE) != O_WRONLY)
+			fuse_reply_err(req, EACCES);
+		else {
+			update = update_file_open(process);
+			if (!update)
+				fuse_reply_err(req, ENOMEM);
+			else {
+				fi->fh = (uint64_t)(intptr_t)update;
+				fi->direct_io = 1;
+				fi->nonseekable = 1;
+				if (fuse_reply_open(req, fi))
+					update_file_release(update);
+			}
+		}
+	} else if (IS_INODE_CTL(ino) && INODE_CTL(ino) == CTL_LIST) {
+		/* list files are opened for listing keys */
+		sts = update_processes(0);
+		process = sts ? 0 : find_process_pid(INODE_PID(ino));
+		if (sts)
+			fuse_reply_err(req, -sts);
+		else if (!process)
+			fuse_reply_err(req, ENOENT);
+		else if ((fi->flags & O_ACCMODE) != O_RDONLY)
+			fuse_reply_err(req, EACCES);
+		else {
+			list = list_file_open(process);
+			if (!list)
+				fuse_reply_err(req, ENOMEM);
+			else {
+				fi->fh = (uint64_t)(intptr_t)list;
+				fi->direct_io = 1;
+				if (fuse_reply_open(req, fi))
+					list_file_release(list);
+			}
+		}
+	} else if (ino == INODE_EVENTS) {
+		if ((fi->flags & O_ACCMODE) != O_RDONLY)
+			fuse_reply_err(req, EACCES);
+		else {
+			reader = events_open(!!(fi->flags & O_NONBLOCK));
+			if (!reader)
+				fuse_reply_err(req, ENOMEM);
+			else {
+				fi->fh = (uint64_t)(intptr_t)reader;
+				fi->direct_io = 1;
+				fi->nonseekable = 1;
+				if (fuse_reply_open(req, fi))
+					events_release(reader);
+			}
+		}
+	} else if (ino != INODE_DIAL || (fi->flags & O_ACCMODE) != O_RDWR)
 		fuse_reply_err(req, EACCES);
 	else {
-		dial_start();
-		fi->direct_io = 1;
-		sts = fuse_reply_open(req, fi);
-		if (sts)
-			dial_stop();
+		agent = dial_start();
+		if (!agent)
+			fuse_reply_err(req, ENOMEM);
+		else {
+			agent->nonblock = !!(fi->flags & O_NONBLOCK);
+			fi->fh = (uint64_t)(intptr_t)agent;
+			fi->direct_io = 1;
+			fi->nonseekable = 1;
+			if (fuse_reply_open(req, fi))
+				dial_stop(agent);
+		}
 	}
 }
 
 static void keyzen_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi)
 {
-	if (ino != INODE_DIAL || !dial_is_started())
+	if (!fi->fh)
+		fuse_reply_err(req, EBADF);
+	else if (IS_INODE_KEY(ino))
+		key_file_read((struct key_file*)(intptr_t)fi->fh, req);
+	else if (IS_INODE_CTL(ino) && INODE_CTL(ino) == CTL_QUERY)
+		query_file_read((struct query_file*)(intptr_t)fi->fh, req, size);
+	else if (IS_INODE_CTL(ino) && INODE_CTL(ino) == CTL_LIST)
+		list_file_read((struct list_file*)(intptr_t)fi->fh, req, size, off);
+	else if (ino == INODE_EVENTS)
+		events_read((struct events_reader*)(intptr_t)fi->fh, req, size);
+	else if (ino != INODE_DIAL)
 		fuse_reply_err(req, EBADF);
 	else
-		dial_read(req, size, off);
+		dial_read((struct dial_agent*)(intptr_t)fi->fh, req, size, off);
 }
 
 
 static void keyzen_write(fuse_req_t req, fuse_ino_t ino, const char *buf, size_t size, off_t off, struct fuse_file_info *fi)
 {
-	if (ino != INODE_DIAL || !dial_is_started())
+	if (!fi->fh)
+		fuse_reply_err(req, EBADF);
+	else if (IS_INODE_CTL(ino) && INODE_CTL(ino) == CTL_QUERY)
+		query_file_write((struct query_file*)(intptr_t)fi->fh, req, buf, size);
+	else if (IS_INODE_CTL(ino) && INODE_CTL(ino) == CTL_UPDATE)
+		update_file_write((struct update_file*)(intptr_t)fi->fh, req, buf, size);
+	else if (ino != INODE_DIAL)
+		fuse_reply_err(req, EBADF);
+	else
+		dial_write((struct dial_agent*)(intptr_t)fi->fh, req, buf, size, off);
+}
+
+static void keyzen_poll(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi, struct fuse_pollhandle *ph)
+{
+	if (!fi->fh)
+		fuse_reply_err(req, EBADF);
+	else if (IS_INODE_KEY(ino))
+		key_file_poll((struct key_file*)(intptr_t)fi->fh, req, ph);
+	else if (IS_INODE_CTL(ino) && INODE_CTL(ino) == CTL_QUERY)
+		query_file_poll((struct query_file*)(intptr_t)fi->fh, req, ph);
+	else if (ino == INODE_EVENTS)
+		events_poll((struct events_reader*)(intptr_t)fi->fh, req, ph);
+	else if (ino != INODE_DIAL)
 		fuse_reply_err(req, EBADF);
 	else
-		dial_write(req, buf, size, off);
+		dial_poll((struct dial_agent*)(intptr_t)fi->fh, req, ph);
 }
 
 static void keyzen_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
 {
-	if (!dial_is_started())
+	if (!fi->fh)
+		fuse_reply_err(req, EBADF);
+	else if (IS_INODE_KEY(ino)) {
+		key_file_release((struct key_file*)(intptr_t)fi->fh);
+		fuse_reply_err(req, 0);
+	} else if (IS_INODE_CTL(ino) && INODE_CTL(ino) == CTL_QUERY) {
+		query_file_release((struct query_file*)(intptr_t)fi->fh);
+		fuse_reply_err(req, 0);
+	} else if (IS_INODE_CTL(ino) && INODE_CTL(ino) == CTL_UPDATE) {
+		update_file_release((struct update_file*)(intptr_t)fi->fh);
+		fuse_reply_err(req, 0);
+	} else if (IS_INODE_CTL(ino) && INODE_CTL(ino) == CTL_LIST) {
+		list_file_release((struct list_file*)(intptr_t)fi->fh);
+		fuse_reply_err(req, 0);
+	} else if (ino == INODE_EVENTS) {
+		events_release((struct events_reader*)(intptr_t)fi->fh);
+		fuse_reply_err(req, 0);
+	} else if (ino != INODE_DIAL)
 		fuse_reply_err(req, EBADF);
 	else {
-		dial_stop();
+		dial_stop((struct dial_agent*)(intptr_t)fi->fh);
 		fuse_reply_err(req, 0);
 	}
 }
@@ -1310,8 +4468,165 @@ static struct fuse_lowlevel_ops keyzen_oper = {
 	.read		= keyzen_read,
 	.write		= keyzen_write,
 	.release	= keyzen_release,
+	.poll		= keyzen_poll,
+};
+
+/*
+** options
+*/
+
+struct keyzen_options {
+	int dial_timeout;
+	int dial_grace;
+	char *dial_default;
+	char *snapshot;
+};
+
+static const struct fuse_opt keyzen_opts[] = {
+	{ "dial_timeout=%d", offsetof(struct keyzen_options, dial_timeout), 0 },
+	{ "dial_grace=%d", offsetof(struct keyzen_options, dial_grace), 0 },
+	{ "dial_default=%s", offsetof(struct keyzen_options, dial_default), 0 },
+	{ "snapshot=%s", offsetof(struct keyzen_options, snapshot), 0 },
+	FUSE_OPT_END
 };
 
+static int parse_options(struct fuse_args *args)
+{
+	struct keyzen_options options;
+
+	options.dial_timeout = dial_timeout;
+	options.dial_grace = dial_grace;
+	options.dial_default = 0;
+	options.snapshot = 0;
+	if (fuse_opt_parse(args, &options, keyzen_opts, NULL) == -1)
+		return -1;
+
+	if (options.dial_timeout < 0) {
+		fprintf(stderr, "keyzen-fs: invalid dial_timeout %d\n", options.dial_timeout);
+		return -1;
+	}
+	dial_timeout = options.dial_timeout;
+
+	if (options.dial_grace < 0) {
+		fprintf(stderr, "keyzen-fs: invalid dial_grace %d\n", options.dial_grace);
+		return -1;
+	}
+	dial_grace = options.dial_grace;
+
+	if (options.dial_default) {
+		if (!strcmp(options.dial_default, "permit"))
+			dial_default_grant = 1;
+		else if (!strcmp(options.dial_default, "deny"))
+			dial_default_grant = 0;
+		else {
+			fprintf(stderr, "keyzen-fs: invalid dial_default %s\n", options.dial_default);
+			free(options.dial_default);
+			return -1;
+		}
+		free(options.dial_default);
+	}
+
+	/* an empty path doesn't publish the snapshot */
+	if (options.snapshot)
+		snapshot_path = options.snapshot;
+	return 0;
+}
+
+/*
+** session loop
+*/
+
+/* like fuse_session_loop but running the timers and the rings */
+static int session_loop(struct fuse_session *se, struct fuse_chan *ch)
+{
+	int res, n, i, rings, alloc;
+	size_t bufsize;
+	char *buf;
+	void *p, *q;
+	struct pollfd *pfds;
+	struct dial_agent *agent, **agents;
+	struct fuse_chan *tmpch;
+
+	bufsize = fuse_chan_bufsize(ch);
+	buf = malloc(bufsize);
+	if (!buf) {
+		fprintf(stderr, "keyzen-fs: failed to allocate read buffer\n");
+		return -1;
+	}
+
+	pfds = 0;
+	agents = 0;
+	alloc = 0;
+	res = 0;
+	while (!fuse_session_exited(se)) {
+		/* the channel and the rings to poll */
+		if (alloc < agent_count + 2) {
+			alloc = agent_count + 8;
+			p = realloc(pfds, alloc * sizeof * pfds);
+			if (p)
+				pfds = p;
+			q = realloc(agents, alloc * sizeof * agents);
+			if (q)
+				agents = q;
+			if (!p || !q) {
+				fprintf(stderr, "keyzen-fs: failed to allocate poll array\n");
+				res = -ENOMEM;
+				break;
+			}
+		}
+		pfds[0].fd = fuse_chan_fd(ch);
+		pfds[0].events = POLLIN;
+		n = 1;
+		for (agent = agent_first ; agent ; agent = agent->next)
+			if (agent->ring.header) {
+				pfds[n].fd = agent->ring.evans;
+				pfds[n].events = POLLIN;
+				agents[n++] = agent;
+			}
+		rings = n;
+		if (snapshot_exits >= 0) {
+			pfds[n].fd = snapshot_exits;
+			pfds[n++].events = POLLIN;
+		}
+
+		res = poll(pfds, n, wheel_timeout());
+		if (res < 0) {
+			if (errno == EINTR)
+				continue;
+			res = -errno;
+			break;
+		}
+
+		/* expire the deadlines */
+		wheel_run();
+
+		/* receive the answers of the rings */
+		for (i = 1 ; i < rings ; i++)
+			if (pfds[i].revents & POLLIN)
+				ring_receive(agents[i]);
+
+		/* drop the rows of the exited processes */
+		if (rings < n && pfds[rings].revents)
+			snapshot_receive_exits();
+
+		if (pfds[0].revents) {
+			tmpch = ch;
+			res = fuse_chan_recv(&tmpch, buf, bufsize);
+			if (res == -EINTR || res == -EAGAIN)
+				continue;
+			if (res <= 0)
+				break;
+			fuse_session_process(se, buf, res, tmpch);
+		}
+		res = 0;
+	}
+
+	free(agents);
+	free(pfds);
+	free(buf);
+	return res < 0 ? -1 : 0;
+}
+
 int main(int argc, char *argv[])
 {
 	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
@@ -1321,8 +4636,11 @@ int main(int argc, char *argv[])
 
 	root_time = time(NULL);
 	procs_init(create_process, destroy_process);
+	wheel_init(DIAL_TICK);
+	wheel_timer_init(&grace_timer, dial_grace_expired, 0);
 
-	if (fuse_parse_cmdline(&args, &mountpoint, NULL, NULL) != -1 &&
+	if (parse_options(&args) != -1 &&
+	    fuse_parse_cmdline(&args, &mountpoint, NULL, NULL) != -1 &&
 	    (ch = fuse_mount(mountpoint, &args)) != NULL) {
 		struct fuse_session *se;
 
@@ -1331,7 +4649,10 @@ int main(int argc, char *argv[])
 		if (se != NULL) {
 			if (fuse_set_signal_handlers(se) != -1) {
 				fuse_session_add_chan(se, ch);
-				err = fuse_session_loop(se);
+				if (snapshot_open() < 0)
+					fprintf(stderr, "keyzen-fs: can't publish the snapshot at %s\n", snapshot_path);
+				err = session_loop(se, ch);
+				snapshot_close();
 				fuse_remove_signal_handlers(se);
 				fuse_session_remove_chan(ch);
 			}
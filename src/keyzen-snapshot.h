@@ -0,0 +1,75 @@
+/* 2014, Copyright Intel & Jose Bollo <jose.bollo@open.eurogiciel.org>, license MIT */
+
+#ifndef KEYZEN_SNAPSHOT_H
+#define KEYZEN_SNAPSHOT_H
+
+#include <stdint.h>
+
+/*
+ * Shared memory snapshot of the keys of the processes.
+ *
+ * keyzen-fs publishes a read only file holding a header followed
+ * by the table of the pids, the rows of the modes and the table
+ * of the keys. Its path is the value of the extended attribute
+ * KEYZEN_XATTR_SNAPSHOT of the root of the mount.
+ *
+ * The table of the pids gives for each pid lower than 'pid_count'
+ * the index of its row plus one, or 0 when the process has no row.
+ * A row is 'row_size' bytes: the byte of index kid is the mode of
+ * the key kid, 0 when the process doesn't have the key.
+ *
+ * The rows may outlive their processes until keyzen-fs scans /proc
+ * again. The table of the starts gives for each row the start time
+ * of its process (field 22 of /proc/PID/stat), or 0 when unknown or
+ * zombie: readers use a row only when it matches the start of the
+ * process. When 'flags' has KEYZEN_SNAPSHOT_EXITS, keyzen-fs drops
+ * the row of a process as soon as it exits, so readers can keep the
+ * start of a pid and read it again only when the row doesn't match.
+ *
+ * The table of the keys has 'key_count' entries sorted on the names
+ * of the keys as strcmp does. The names are not zero terminated.
+ *
+ * The file never shrinks and the data are within its 'size' first
+ * bytes, so readers can map KEYZEN_SNAPSHOT_MAX bytes once.
+ *
+ * 'seq' is odd while keyzen-fs is writing. Readers read 'seq', the
+ * data and then 'seq' again and retry when it is odd or changed.
+ * When 'state' isn't KEYZEN_SNAPSHOT_ALIVE, the data are obsolete.
+ */
+
+#define KEYZEN_SNAPSHOT_MAGIC    0x4b5a534e  /* "KZSN" */
+#define KEYZEN_SNAPSHOT_VERSION  2
+#define KEYZEN_SNAPSHOT_MAX      (64 << 20)  /* maximum size of the file */
+#define KEYZEN_SNAPSHOT_PIDS     32768       /* pids of rows are lower */
+
+#define KEYZEN_SNAPSHOT_ALIVE    0
+#define KEYZEN_SNAPSHOT_CLOSED   1           /* keyzen-fs stopped */
+#define KEYZEN_SNAPSHOT_OVERFLOW 2           /* too big to be published */
+
+#define KEYZEN_SNAPSHOT_EXITS    1           /* flag: rows dropped at exit */
+
+struct keyzen_snapshot_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t seq;
+	uint32_t state;
+	uint32_t size;            /* count of bytes of data */
+	uint32_t pid_count;
+	uint32_t pids_offset;     /* uint32_t[pid_count] */
+	uint32_t row_size;
+	uint32_t rows_offset;
+	uint32_t key_count;
+	uint32_t keys_offset;     /* struct keyzen_snapshot_key[key_count] */
+	uint32_t names_offset;
+	uint32_t starts_offset;   /* uint64_t[count of rows] */
+	uint32_t flags;
+	uint32_t reserved[2];
+};
+
+struct keyzen_snapshot_key {
+	uint32_t offset;          /* offset of the name from 'names_offset' */
+	uint32_t length;          /* length of the name */
+	uint32_t kid;
+};
+
+#endif
@@ -1,10 +1,14 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <fnmatch.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <string.h>
 #include <errno.h>
+#include <poll.h>
 
 const char *typename(char t)
 {
@@ -18,56 +22,262 @@ const char *typename(char t)
 	return 0;
 }
 
-void server(const char *dial)
+struct rule {
+	char *exe;		/* glob of the executable */
+	char *key;		/* prefix of the key */
+	size_t keylen;
+	char grant;		/* 'y', 'n' or '?' for asking */
+	char type;		/* the type to answer or 0 */
+};
+
+struct rule *rules = 0;
+int rule_count = 0;
+
+/* read the rules: lines of "exe-glob key-prefix verdict", # for comments */
+int load_rules(const char *path)
+{
+	FILE *file;
+	char line[4096], exe[4096], key[2048], verdict[4];
+	struct rule *r;
+	int n, lino;
+
+	file = fopen(path, "r");
+	if (!file) {
+		printf("can't open %s %m\n", path);
+		return -1;
+	}
+	lino = 0;
+	while (fgets(line, sizeof line, file)) {
+		lino++;
+		n = sscanf(line, "%4095s %2047s %3s", exe, key, verdict);
+		if (n <= 0 || exe[0] == '#')
+			continue;
+		if (n != 3 || !strchr("yn?", verdict[0]) || (verdict[1] && (verdict[0] == '?' || !typename(verdict[1]) || verdict[2]))) {
+			printf("%s:%d: bad rule\n", path, lino);
+			fclose(file);
+			return -1;
+		}
+		r = realloc(rules, (rule_count + 1) * sizeof * rules);
+		if (!r) {
+			fclose(file);
+			return -1;
+		}
+		rules = r;
+		r += rule_count++;
+		n = (int)strlen(key);
+		if (n && key[n - 1] == '*')
+			key[--n] = 0;
+		r->exe = strdup(exe);
+		r->key = strdup(key);
+		r->keylen = n;
+		r->grant = verdict[0];
+		r->type = verdict[1];
+	}
+	fclose(file);
+	printf("%d rule(s) loaded\n", rule_count);
+	return 0;
+}
+
+/* the first rule matching the executable and the key */
+struct rule *match_rule(const char *exe, const char *key)
+{
+	int i;
+
+	for (i = 0 ; i < rule_count ; i++)
+		if (!strncmp(key, rules[i].key, rules[i].keylen) && !fnmatch(rules[i].exe, exe, 0))
+			return &rules[i];
+	return 0;
+}
+
+/* decode in place the %XX escapes of the context */
+void unescape(char *s)
+{
+	char *d;
+	unsigned x;
+
+	for (d = s ; *s ; s++) {
+		if (*s == '%' && sscanf(s + 1, "%2x", &x) == 1) {
+			*d++ = (char)x;
+			s += 2;
+		} else
+			*d++ = *s;
+	}
+	*d = 0;
+}
+
+long long now_us()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* answers waiting to be written and the statistics of the latencies */
+char out[65536];
+int out_len = 0, out_count = 0;
+long long out_since = 0, stat_count = 0, stat_total = 0, stat_max = 0;
+
+void report()
+{
+	if (stat_count)
+		printf("%lld decision(s) by rules, latency mean %lldus max %lldus\n",
+			stat_count, stat_total / stat_count, stat_max);
+}
+
+int flush_answers(int f)
+{
+	long long t;
+	int w;
+
+	if (!out_len)
+		return 0;
+	w = (int)write(f, out, out_len);
+	if (w != out_len) {
+		printf("error while writing dial %d/%d %m\n",out_len,w);
+		return -1;
+	}
+	if (out_count) {
+		t = now_us() - out_since;
+		stat_count += out_count;
+		stat_total += t * out_count;
+		if (t > stat_max)
+			stat_max = t;
+		if (stat_count / 10000 != (stat_count - out_count) / 10000)
+			report();
+	}
+	out_len = 0;
+	out_count = 0;
+	return 0;
+}
+
+/* answer the request, prompting when needed */
+int answer(int f, int seq, int pid, const char *exe, char type, const char *name, int verbose)
 {
-	int f = open(dial, O_RDWR|O_NONBLOCK);
+	char buffer[100], *pstr, ans;
+	struct rule *rule;
+
+	rule = rule_count ? match_rule(exe, name) : 0;
+	if (rule && rule->grant != '?') {
+		ans = rule->grant;
+		if (rule->type)
+			type = rule->type;
+		else if (type != '*')
+			type = ans == 'y' ? '=' : '-';
+		if (verbose)
+			printf("For pid=%d (%s), key %s: %c%c\n",pid,exe,name,ans,type);
+		if (out_len + 32 > (int)sizeof out && flush_answers(f))
+			return -1;
+		out_len += sprintf(out + out_len, "%d %c%c\n", seq, ans, type);
+		out_count++;
+		return 0;
+	}
+
+	/* interactive */
+	if (flush_answers(f))
+		return -1;
+	printf("For pid=%d, key %s of type %c: %s\n",pid,name,type,typename(type));
+	do {
+		printf(" .. do you grant (y/n)? ");
+		errno = 0;
+		pstr = fgets(buffer, sizeof buffer, stdin);
+	} while (pstr && buffer[0]!='y' && buffer[0]!='n');
+	if (!pstr) {
+		if (errno)
+			printf("error while reading stdin %m\n");
+		else
+			printf("disconnecting\n");
+		return -1;
+	}
+	ans = buffer[0];
+	if (type != '*')
+		type = ans == 'y' ? '=' : '-';
+	out_len = sprintf(out, "%d %c%c\n", seq, ans, type);
+	out_count = 0;
+	return flush_answers(f);
+}
+
+void server(const char *dial, const char *rulesfile, int verbose)
+{
+	int f;
+
+	if (rulesfile && load_rules(rulesfile))
+		return;
+	f = open(dial, O_RDWR|O_NONBLOCK);
 	if (f < 0)
 		printf("can't open %s\n",dial);
 	else {
-		char buffer[2048], name[2048], type, ans, *pstr;
-		int n, pid, seq, w;
+		char buffer[65536], name[2048], exe[4096], cgroup[4096], type, *line, *eol;
+		int n, pid, seq, len, context;
+		unsigned uid;
+		unsigned long long session;
+		struct pollfd pfd;
+		/* the rules need the context of the processes */
+		context = rulesfile != 0;
+		if (context && write(f, "context 1\n", 10) != 10) {
+			printf("can't get the context of the processes from %s (%m), the rules can't be applied\n", dial);
+			close(f);
+			return;
+		}
 		printf("keyzen authorization server started\n");
+		strcpy(exe, "-");
+		len = 0;
+		pfd.fd = f;
+		pfd.events = POLLIN;
 		for (;;) {
-			printf("waiting..."); fflush(stdout);
-			n = read(f, buffer, sizeof buffer - 1);
-			printf("\n");
-			if (n <= 0) {
-				printf("error while reading dial %d %m\n",n);
-				break;
+			if (!rulesfile) {
+				printf("waiting..."); fflush(stdout);
 			}
-			buffer[n] = 0;
-			n = sscanf(buffer, "%d %d %c%s", &seq, &pid, &type, name);
-			if (n != 4) {
-				printf("error while scanning dial %d field(s) read\n",n);
+			n = poll(&pfd, 1, -1);
+			if (n < 0) {
+				printf("\nerror while polling dial %m\n");
 				break;
 			}
-			printf("For pid=%d, key %s of type %c: %s\n",pid,name,type,typename(type));
-			do {
-				printf(" .. do you grant (y/n)? ");
-				errno = 0;
-				pstr = fgets(buffer, sizeof buffer, stdin);
-			} while (pstr && buffer[0]!='y' && buffer[0]!='n');
-			if (!pstr) {
-				if (errno)
-					printf("error while reading stdin %m\n");
-				else
-					printf("disconnecting\n");
+			n = read(f, buffer + len, sizeof buffer - 1 - len);
+			if (!rulesfile)
+				printf("\n");
+			if (n < 0 && errno == EAGAIN)
+				continue;
+			if (n <= 0) {
+				printf("error while reading dial %d %m\n",n);
 				break;
 			}
-			ans = buffer[0];
-			if (ans != 'y' && ans != 'n') {
-				printf("internal error ans=%c\n",ans);
-				break;
+			out_since = now_us();
+			len += n;
+			buffer[len] = 0;
+			/* treat all the complete lines */
+			line = buffer;
+			while ((eol = strchr(line, '\n'))) {
+				*eol = 0;
+				if (context) {
+					n = sscanf(line, "%d %d %u %llu %4095s %4095s %c%2047s", &seq, &pid, &uid, &session, exe, cgroup, &type, name);
+					if (n == 8) {
+						unescape(exe);
+						n = 4;
+					}
+				} else
+					n = sscanf(line, "%d %d %c%2047s", &seq, &pid, &type, name);
+				if (n != 4) {
+					printf("error while scanning dial %d field(s) read\n",n);
+					goto end;
+				}
+				if (answer(f, seq, pid, exe, type, name, verbose))
+					goto end;
+				line = eol + 1;
 			}
-			if (type != '*')
-				type = ans == 'y' ? '=' : '-';
-			n = sprintf(buffer, "%d %c%c\n", seq, ans, type);
-			w = (int)write(f, buffer, n);
-			if (n != w) {
-				printf("error while writing dial %d/%d %m\n",n,w);
+			/* send the answers of the batch */
+			if (flush_answers(f))
+				goto end;
+			/* keep the incomplete line */
+			len = (int)(buffer + len - line);
+			memmove(buffer, line, len);
+			if (len == sizeof buffer - 1) {
+				printf("error line too long\n");
 				break;
 			}
 		}
+end:
+		report();
 		printf("keyzen authorization server stopped\n");
 	}
 }
@@ -85,9 +295,22 @@ int main(int argc, char **argv)
 		while (*++argv)
 			printf("%s: %s\n",*argv,access(*argv,F_OK) ? "DENIED" : "ALLOWED");
 	} else if (*argv && !strcmp(*argv,"server")) {
-		server(*++argv);
+		const char *rulesfile = 0;
+		int verbose = 0;
+		for (;;) {
+			if (argv[1] && !strcmp(argv[1],"--rules") && argv[2]) {
+				rulesfile = argv[2];
+				argv += 2;
+			} else if (argv[1] && !strcmp(argv[1],"-v")) {
+				verbose = 1;
+				argv++;
+			} else
+				break;
+		}
+		server(*++argv, rulesfile, verbose);
 	} else {
-		printf("usage: %s add|drop|ask|server files...\n",*--argv);
+		printf("usage: %s add|drop|ask files...\n",*--argv);
+		printf("       %s server [--rules FILE] [-v] dial\n",*argv);
 	}
 	return 0;
 }
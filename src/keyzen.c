@@ -1,5 +1,7 @@
 /* 2014, Copyright Intel & Jose Bollo <jose.bollo@open.eurogiciel.org>, license MIT */
 
+#define _GNU_SOURCE
+
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
@@ -7,10 +9,20 @@
 #include <dirent.h>
 #include <errno.h>
 #include <assert.h>
+#include <pthread.h>
+#include <time.h>
+#include <stdio.h>
 #include <sys/types.h>
+#include <mntent.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/statfs.h>
+#include <sys/xattr.h>
 
 #include "keyzen.h"
+#include "keyzen-snapshot.h"
 #include "itoa.c"
 
 struct item {
@@ -22,155 +34,432 @@ struct item {
 #define FLAG_EXIST  1
 #define FLAG_KEEP   2
 
-static char mountpoint[PATH_MAX];
-static int mountlength = 0;
-static int mpidlength = 0;
-static int mkeylength = 0;
+#define FUSE_SUPER_MAGIC	0x65735546
+
+#define DIRFDS_COUNT	8	/* count of directories of pids kept opened */
+#define STARTS_COUNT	64	/* count of start times of pids kept, power of 2 */
+#define CACHE_SIZE		256	/* count of buckets of the cache, MUST be a power of 2 */
+#define CACHE_MAX		4096	/* maximum count of cached items */
+#define SNAPSHOT_RETRY	64		/* count of reads of the snapshot before asking keyzen-fs */
+#define BATCH_EVENTS	64		/* count of events read at once by a batch */
+
+/* a verdict for a key of a process at a generation */
+struct verdict {
+	struct verdict *next;
+	pid_t pid;
+	unsigned long generation;
+	int status;
+	char key[1];
+};
+
+/* the last known generation of a process */
+struct generation {
+	struct generation *next;
+	pid_t pid;
+	unsigned long value;
+	long long expire;
+};
+
+/* the cache of verdicts */
+struct cache {
+	int count;
+	struct verdict *verdicts[CACHE_SIZE];
+	struct generation *generations[CACHE_SIZE];
+};
+
+/*
+the state of the requests: the keys are accessed relatively to the
+directories of the pids opened with O_PATH from the root of the mount.
+the opened directories belong to the process 'owner' and are dropped
+by its forked children.
+*/
+struct keyzen_ctx {
+	char mountpoint[PATH_MAX];
+	int mountlength;
+	dev_t mountdev;
+	pid_t owner;
+	int rootfd;
+	int selffd;
+	int updatefd;	/* -1 when not opened */
+	int dirnext;
+	struct {
+		pid_t pid;
+		int fd;
+		int queryfd;	/* -1 when not opened */
+	} dirfds[DIRFDS_COUNT];
+	struct {
+		pid_t pid;
+		uint64_t start;
+	} starts[STARTS_COUNT];	/* start times of the checked pids */
+	int cache_ttl;
+	struct cache *cache;
+	size_t entries_array_count;
+	size_t entries_array_alloc;
+	struct item *entries_array;
+	size_t entries_data_count;
+	size_t entries_data_alloc;
+	char *entries_data;
+};
+
+/* a check of a batch */
+struct batch_check {
+	struct batch_check *next;
+	struct batch_check *prev;
+	int fd;			/* the query file, -1 when completed */
+	int count;
+	int status;
+	void *closure;
+};
+
+/*
+the checks of a batch are waiting on their query file opened with
+O_NONBLOCK and watched by 'epfd'. the completed checks are queued
+until reaped, 'evfd' tells 'epfd' that the queue isn't empty.
+*/
+struct keyzen_batch {
+	keyzen_ctx *ctx;
+	int epfd;
+	int evfd;
+	int count;		/* count of checks not reaped */
+	struct batch_check *pending;
+	struct batch_check *done_first;
+	struct batch_check *done_last;
+};
+
 static char devname[] = KEYZEN_FS_KEY;
+static char fstype[] = "fuse." KEYZEN_FS_KEY;
 static char self[] = KEYZEN_SELF_NAME;
 static char adminkey[] = KEYZEN_ADMIN_KEY;
+static char query[] = KEYZEN_QUERY_NAME;
+static char update[] = KEYZEN_UPDATE_NAME;
+static char listname[] = KEYZEN_LIST_NAME;
+
+/* the context of the thread for the functions without context */
+static __thread keyzen_ctx *thread_ctx = 0;
+static int thread_cache_ttl = 0;
+static pthread_key_t thread_ctx_key;
+static pthread_once_t thread_ctx_once = PTHREAD_ONCE_INIT;
+
+/* the mount point detected for the process */
+static pthread_mutex_t mount_mutex = PTHREAD_MUTEX_INITIALIZER;
+static char mount_path[PATH_MAX];
+static int mount_length = 0;
+static dev_t mount_dev;
+
+/*
+the snapshot published by keyzen-fs, mapped once for the process.
+the threads reading it are counted by 'snapshot_readers' so that the
+forgotten mappings, kept in 'snapshot_retired', are unmapped when no
+thread reads them anymore.
+*/
+struct snapshot_mapping {
+	struct snapshot_mapping *next;
+	const struct keyzen_snapshot_header *header;
+};
 
-static size_t entries_array_count = 0;
-static size_t entries_array_alloc = 0;
-static struct item *entries_array = 0;
-static size_t entries_data_count = 0;
-static size_t entries_data_alloc = 0;
-static char *entries_data = 0;
+static pthread_mutex_t snapshot_mutex = PTHREAD_MUTEX_INITIALIZER;
+static const struct keyzen_snapshot_header *snapshot = 0;
+static int snapshot_tried = 0;
+static int snapshot_readers = 0;
+static struct snapshot_mapping *snapshot_retired = 0;
+
+/*
+the start time of the calling process, checked against the rows of
+the snapshot. it is forgotten by the children of fork.
+*/
+static pthread_once_t self_start_once = PTHREAD_ONCE_INIT;
+static pid_t self_start_pid = 0;
+static uint64_t self_start = 0;
+
+/* check that 'path' is the root of keyzen-fs and get its device */
+static int check_mount_point(const char *path, dev_t *dev)
+{
+	char dial[PATH_MAX];
+	struct statfs sfs;
+	struct stat st, std;
+	int n;
 
-static int detect_keyzen_mount_point(const char *dev, char *path, int pathlen)
+	if (statfs(path, &sfs) < 0)
+		return -errno;
+	if (sfs.f_type != FUSE_SUPER_MAGIC)
+		return -ENOTSUP;
+	if (stat(path, &st) < 0)
+		return -errno;
+
+	/* the root of keyzen-fs has the file dial on the same device */
+	n = snprintf(dial, sizeof dial, "%s/%s", path, KEYZEN_DIAL_NAME);
+	if (n < 0 || n >= (int)sizeof dial)
+		return -ENAMETOOLONG;
+	if (stat(dial, &std) < 0 || std.st_dev != st.st_dev)
+		return -ENOTSUP;
+	*dev = st.st_dev;
+	return 0;
+}
+
+/* set the mount point to 'path' if it is valid */
+static int set_mount_point(const char *path)
 {
-	char buffer[8192];
-	int file;
+	size_t length;
+
+	length = strlen(path);
+	if (length >= sizeof mount_path)
+		return -ENAMETOOLONG;
+	if (check_mount_point(path, &mount_dev) < 0)
+		return -ENOTSUP;
+	memcpy(mount_path, path, length + 1);
+	return (int)length;
+}
+
+/*
+detect the mount point: the one given by the environment, else the
+well known one, else the first mount of keyzen-fs made by root. a
+path that isn't the root of keyzen-fs is skipped.
+*/
+static int detect_keyzen_mount_point()
+{
+	char buffer[3 * PATH_MAX];
+	const char *path;
+	struct mntent entry;
+	FILE *file;
 	int result;
-	int rlen;
-	int pos;
-	int state;
-	int len;
-
-	/* open the file */
-	file = open("/proc/self/mounts", O_RDONLY);
-	if (file < 0)
-		result = -errno;
-	else {
-		/* read the file */
-		len = 0;
-		state = 0;
-		result = 0;
-		do {
-			rlen = (int)read(file, buffer, sizeof buffer);
-			if (rlen < 0)
-				result = -errno;
-			else if (rlen == 0)
-				result = -ENOTSUP; /* no fullfill case state == -1 because trailing fields */
-			else {
-				pos = 0;
-				while(pos < rlen && !result) {
-					switch (state) {
-					case -1:
-
-						while (pos < rlen) {
-							if (len >= pathlen) {
-								result = -ENAMETOOLONG;
-								break;
-							} else if (buffer[pos] == ' ') {
-								result = len;
-								buffer[len] = 0;
-								break;
-							} else {
-								path[len++] = buffer[pos++];
-							}
-						}
-						break;
-
-					case -2:
-						while (pos < rlen) {
-							if (buffer[pos++] == '\n') {
-								state = 0;
-								break;
-							}
-						}
-						break;
-
-					default:
-						while (pos < rlen) {
-							if (buffer[pos] == dev[state]) {
-								pos++;
-								state++;
-							} else if (!dev[state] && buffer[pos] == ' ') {
-								pos++;
-								state = -1;
-								break;
-							} else {
-								state = -2;
-								break;
-							}
-						}
-						break;
-					}
-				}
-			}
-		} while (!result);
-		/* close and return */
-		close(file);
+
+	path = secure_getenv(KEYZEN_MOUNTPOINT_ENV);
+	if (path && *path) {
+		result = set_mount_point(path);
+		if (result > 0)
+			return result;
 	}
 
+	result = set_mount_point(KEYZEN_MOUNTPOINT);
+	if (result > 0)
+		return result;
+
+	file = setmntent("/proc/self/mounts", "r");
+	if (!file)
+		return -errno;
+	result = -ENOTSUP;
+	while (result < 0 && getmntent_r(file, &entry, buffer, sizeof buffer))
+		if ((!strcmp(entry.mnt_fsname, devname) || !strcmp(entry.mnt_type, fstype))
+		 && hasmntopt(&entry, "user_id=0"))
+			result = set_mount_point(entry.mnt_dir);
+	endmntent(file);
+	if (result < 0)
+		result = -ENOTSUP;
+
 	return result;
 }
 
-static int ensure_mount_point()
+static int ensure_mount_point(keyzen_ctx *ctx)
 {
-	if (mountlength == 0)
-		mountlength = detect_keyzen_mount_point(devname, mountpoint, (int)sizeof mountpoint);
-	return mountlength < 0 ? mountlength : 0;
+	if (ctx->mountlength == 0) {
+		pthread_mutex_lock(&mount_mutex);
+		if (mount_length <= 0)
+			mount_length = detect_keyzen_mount_point();
+		ctx->mountlength = mount_length;
+		if (mount_length > 0) {
+			memcpy(ctx->mountpoint, mount_path, (size_t)mount_length + 1);
+			ctx->mountdev = mount_dev;
+		}
+		pthread_mutex_unlock(&mount_mutex);
+	}
+	return ctx->mountlength < 0 ? ctx->mountlength : 0;
 }
 
-static const char *pidstr(pid_t pid)
+/* forget the mount point of 'ctx' for detecting it again */
+static void forget_mount_point(keyzen_ctx *ctx)
 {
-	static char buffer[20];
+	pthread_mutex_lock(&mount_mutex);
+	if (mount_length > 0 && mount_dev == ctx->mountdev && !strcmp(mount_path, ctx->mountpoint))
+		mount_length = 0;
+	pthread_mutex_unlock(&mount_mutex);
+	ctx->mountlength = 0;
+}
+
+/* open the root of the mount, checking it is still the same */
+static int open_root(keyzen_ctx *ctx)
+{
+	struct stat st;
+	int fd;
+
+	fd = open(ctx->mountpoint, O_PATH|O_DIRECTORY|O_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+	if (fstat(fd, &st) < 0 || st.st_dev != ctx->mountdev) {
+		close(fd);
+		return -ESTALE;
+	}
+	return fd;
+}
 
+static const char *pidstr(pid_t pid, char buffer[20])
+{
 	itoa((int)pid, buffer);
 	return buffer;
 }
 
-static int append_path(const char *item, int base)
+/* close the directories, must be called by the owner or a forked child */
+static void close_dirfds(keyzen_ctx *ctx)
 {
 	int i;
 
-	assert(item);
+	if (ctx->owner) {
+		for (i = 0 ; i < DIRFDS_COUNT ; i++)
+			if (ctx->dirfds[i].pid) {
+				close(ctx->dirfds[i].fd);
+				if (ctx->dirfds[i].queryfd >= 0)
+					close(ctx->dirfds[i].queryfd);
+			}
+		if (ctx->selffd >= 0)
+			close(ctx->selffd);
+		if (ctx->updatefd >= 0)
+			close(ctx->updatefd);
+		close(ctx->rootfd);
+	}
+	memset(ctx->dirfds, 0, sizeof ctx->dirfds);
+	ctx->owner = 0;
+}
 
-	i = base;
-	mountpoint[i++] = '/';
-	while (*item) {
-		if (i >= (int)sizeof mountpoint)
-			return -ENAMETOOLONG;
-		mountpoint[i++] = *item++;
+/* get the root of the mount, opening it if needed */
+static int get_rootfd(keyzen_ctx *ctx)
+{
+	pid_t pid;
+	int result;
+
+	pid = getpid();
+	if (ctx->owner != pid) {
+		/* first time or forked */
+		close_dirfds(ctx);
+		result = ensure_mount_point(ctx);
+		if (result < 0)
+			return result;
+		result = open_root(ctx);
+		if (result < 0) {
+			/* the mount changed, detect it again */
+			forget_mount_point(ctx);
+			result = ensure_mount_point(ctx);
+			if (result < 0)
+				return result;
+			result = open_root(ctx);
+			if (result < 0)
+				return result;
+		}
+		ctx->rootfd = result;
+		ctx->selffd = -1;
+		ctx->updatefd = -1;
+		ctx->dirnext = 0;
+		ctx->owner = pid;
 	}
-	if (i >= (int)sizeof mountpoint)
-		return -ENAMETOOLONG;
+	return ctx->rootfd;
+}
 
-	mountpoint[i] = 0;
+/* get the directory of the current process */
+static int get_self_dirfd(keyzen_ctx *ctx)
+{
+	int result;
+
+	result = get_rootfd(ctx);
+	if (result >= 0 && ctx->selffd < 0) {
+		result = openat(result, self, O_PATH|O_DIRECTORY|O_CLOEXEC);
+		if (result < 0)
+			return -errno;
+		ctx->selffd = result;
+	}
+	return result < 0 ? result : ctx->selffd;
+}
+
+/* get the update file of the current process */
+static int get_self_updatefd(keyzen_ctx *ctx)
+{
+	int result;
+
+	result = get_self_dirfd(ctx);
+	if (result >= 0 && ctx->updatefd < 0) {
+		result = openat(result, update, O_WRONLY|O_CLOEXEC);
+		if (result < 0)
+			return errno == ENOENT ? -ENOTSUP : -errno;
+		ctx->updatefd = result;
+	}
+	return result < 0 ? result : ctx->updatefd;
+}
+
+/* get the index in dirfds of the directory of the process 'pid' */
+static int get_pid_slot(keyzen_ctx *ctx, pid_t pid)
+{
+	char buffer[20];
+	int i, result;
+
+	result = get_rootfd(ctx);
+	if (result < 0)
+		return result;
+
+	for (i = 0 ; i < DIRFDS_COUNT ; i++)
+		if (ctx->dirfds[i].pid == pid)
+			return i;
+
+	result = openat(result, pidstr(pid, buffer), O_PATH|O_DIRECTORY|O_CLOEXEC);
+	if (result < 0)
+		return -errno;
+
+	/* replace the oldest */
+	i = ctx->dirnext;
+	ctx->dirnext = (i + 1) % DIRFDS_COUNT;
+	if (ctx->dirfds[i].pid) {
+		close(ctx->dirfds[i].fd);
+		if (ctx->dirfds[i].queryfd >= 0)
+			close(ctx->dirfds[i].queryfd);
+	}
+	ctx->dirfds[i].pid = pid;
+	ctx->dirfds[i].fd = result;
+	ctx->dirfds[i].queryfd = -1;
 	return i;
 }
 
-static int set_pid_path(const char *pid)
+/* get the directory of the process 'pid' */
+static int get_pid_dirfd(keyzen_ctx *ctx, pid_t pid)
 {
-	mpidlength = append_path(pid, mountlength);
-	return mpidlength;
+	int i;
+
+	i = get_pid_slot(ctx, pid);
+	return i < 0 ? i : ctx->dirfds[i].fd;
 }
 
-static int set_key_path(const char *key)
+/* get the query file of the process 'pid' */
+static int get_pid_queryfd(keyzen_ctx *ctx, pid_t pid)
 {
-	mkeylength = append_path(key, mpidlength);
-	return mkeylength;
+	int i, result;
+
+	i = get_pid_slot(ctx, pid);
+	if (i < 0)
+		return i;
+
+	if (ctx->dirfds[i].queryfd < 0) {
+		result = openat(ctx->dirfds[i].fd, query, O_RDWR|O_CLOEXEC);
+		if (result < 0)
+			return errno == ENOENT ? -ENOTSUP : -errno;
+		ctx->dirfds[i].queryfd = result;
+	}
+	return ctx->dirfds[i].queryfd;
 }
 
-static void clear_entries()
+/* close the query file of the process 'pid' */
+static void drop_pid_queryfd(keyzen_ctx *ctx, pid_t pid)
 {
-	entries_array_count = 0;
-	entries_data_count = 0;
+	int i;
+
+	for (i = 0 ; i < DIRFDS_COUNT ; i++)
+		if (ctx->dirfds[i].pid == pid && ctx->dirfds[i].queryfd >= 0) {
+			close(ctx->dirfds[i].queryfd);
+			ctx->dirfds[i].queryfd = -1;
+		}
 }
 
-static int get_entry(const char *entry, int create, int flag)
+static void clear_entries(keyzen_ctx *ctx)
+{
+	ctx->entries_array_count = 0;
+	ctx->entries_data_count = 0;
+}
+
+static int get_entry(keyzen_ctx *ctx, const char *entry, int create, int flag)
 {
 	int l, u, i, s;
 	char *data;
@@ -192,10 +481,10 @@ static int get_entry(const char *entry, int create, int flag)
 
 	/* search entry index */
 	l = 0;
-	u = entries_array_count;
+	u = ctx->entries_array_count;
 	while (l < u) {
 		i = (l + u) >> 1;
-		s = strcmp(entry, entries_array[i].entry);
+		s = strcmp(entry, ctx->entries_array[i].entry);
 		if (s == 0)
 			return i;
 		if (s < 0)
@@ -210,72 +499,74 @@ static int get_entry(const char *entry, int create, int flag)
 
 	/* prepare the entry data */
 	len = 1 + strlen(entry);
-	count = entries_data_count + len;
-	alloc = entries_data_alloc;
+	count = ctx->entries_data_count + len;
+	alloc = ctx->entries_data_alloc;
 	while (count > alloc)
 		alloc = alloc < 1000 ? 1000 : 2*alloc;
-	if (alloc != entries_data_alloc) {
-		ptr = realloc(entries_data, alloc * sizeof * entries_data);
+	if (alloc != ctx->entries_data_alloc) {
+		ptr = realloc(ctx->entries_data, alloc * sizeof * ctx->entries_data);
 		if (!ptr)
 			return -ENOMEM;
-		entries_data = ptr;
-		entries_data_alloc = alloc;
+		ctx->entries_data = ptr;
+		ctx->entries_data_alloc = alloc;
 	}
 
 	/* prepare the entry array */
-	alloc = entries_array_alloc;
-	while (entries_array_count >= alloc)
+	alloc = ctx->entries_array_alloc;
+	while (ctx->entries_array_count >= alloc)
 		alloc = alloc < 30 ? 30 : 2*alloc;
-	if (alloc != entries_array_alloc) {
-		ptr = realloc(entries_array, alloc * sizeof * entries_array);
+	if (alloc != ctx->entries_array_alloc) {
+		ptr = realloc(ctx->entries_array, alloc * sizeof * ctx->entries_array);
 		if (!ptr)
 			return -ENOMEM;
-		entries_array = ptr;
-		entries_array_alloc = alloc;
+		ctx->entries_array = ptr;
+		ctx->entries_array_alloc = alloc;
 	}
 
 	/* insert the data */
-	u = entries_array_count++;
+	u = ctx->entries_array_count++;
 	while (u > l) {
 		i = u - 1;
-		entries_array[u] = entries_array[i];
+		ctx->entries_array[u] = ctx->entries_array[i];
 		u = i;
 	}
-	data = entries_data + entries_data_count;
-	entries_array[u].entry = data;
+	data = ctx->entries_data + ctx->entries_data_count;
+	ctx->entries_array[u].entry = data;
 	memcpy(data, entry, len);
-	entries_data_count = count;
-	entries_array[u].flag = flag;
+	ctx->entries_data_count = count;
+	ctx->entries_array[u].flag = flag;
 	return u;
 }
 
-static int internal_list_keys(const char *pid)
+static int internal_list_keys(keyzen_ctx *ctx, int dirfd)
 {
 	int result;
 	int sts;
 	DIR *dir;
 	struct dirent *entry;
 
-	clear_entries();
+	clear_entries(ctx);
 
-	result = ensure_mount_point();
-	if (result < 0)
-		return result;
+	if (dirfd < 0)
+		return dirfd;
 
-	result = set_pid_path(pid);
-	if (result < 0)
-		return result;
-
-	dir = opendir(mountpoint);
-	if (!dir)
+	sts = openat(dirfd, ".", O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+	if (sts < 0)
 		return -errno;
 
+	dir = fdopendir(sts);
+	if (!dir) {
+		result = -errno;
+		close(sts);
+		return result;
+	}
+
 	result = 0;
 	errno = 0;
 	entry = readdir(dir);
 	while (entry && !result) {
 		if (entry->d_type == DT_REG) {
-			sts = get_entry(entry->d_name, 1, FLAG_EXIST);
+			sts = get_entry(ctx, entry->d_name, 1, FLAG_EXIST);
 			if (sts < 0)
 				result = sts;
 		}
@@ -289,7 +580,58 @@ static int internal_list_keys(const char *pid)
 	return result;
 }
 
-static int internal_export_list_keys(const char *pid, void **list)
+/* read the list of keys of the directory 'dirfd' from its list file */
+static int internal_read_list_keys(int dirfd, void **list)
+{
+	char *data, *p;
+	size_t size, alloc;
+	ssize_t rc;
+	int fd, n;
+
+	fd = openat(dirfd, listname, O_RDONLY|O_CLOEXEC);
+	if (fd < 0)
+		return errno == ENOENT ? -ENOTSUP : -errno;
+
+	/* read the whole file */
+	size = 0;
+	alloc = 0;
+	data = 0;
+	do {
+		if (size == alloc) {
+			alloc = alloc ? 2 * alloc : 4096;
+			p = realloc(data, alloc);
+			if (!p) {
+				free(data);
+				close(fd);
+				return -ENOMEM;
+			}
+			data = p;
+		}
+		rc = read(fd, data + size, alloc - size);
+		if (rc < 0 && errno != EINTR) {
+			rc = -errno;
+			free(data);
+			close(fd);
+			return (int)rc;
+		}
+		if (rc > 0)
+			size += (size_t)rc;
+	} while (rc);
+	close(fd);
+
+	/* check it */
+	if (size < sizeof(int)
+	 || (n = *(int*)data) < 0
+	 || (size_t)(n + 1) * sizeof(int) > size
+	 || (n && data[size - 1])) {
+		free(data);
+		return -EIO;
+	}
+	*list = data;
+	return 0;
+}
+
+static int internal_export_list_keys(keyzen_ctx *ctx, int dirfd, void **list)
 {
 	int result;
 	int *data;
@@ -297,42 +639,40 @@ static int internal_export_list_keys(const char *pid, void **list)
 	int i;
 	int o;
 
-	result = internal_list_keys(pid);
+	if (dirfd < 0)
+		return dirfd;
+
+	result = internal_read_list_keys(dirfd, list);
+	if (result != -ENOTSUP)
+		return result;
+
+	result = internal_list_keys(ctx, dirfd);
 	if (result < 0)
 		return result;
 
-	data = malloc((1+entries_array_count) * sizeof(int) + entries_data_count);
+	data = malloc((1+ctx->entries_array_count) * sizeof(int) + ctx->entries_data_count);
 	if (!data)
 		return -ENOMEM;
 
-	n = entries_array_count;
+	n = ctx->entries_array_count;
 	o = (n+1) * sizeof(int);
 	data[0] = n;
 	for (i = 1 ; i <= n ; i++)
-		data[i] = o + (int)(entries_array[i-1].entry - entries_data);
-	memcpy(data+i, entries_data, entries_data_count);
+		data[i] = o + (int)(ctx->entries_array[i-1].entry - ctx->entries_data);
+	memcpy(data+i, ctx->entries_data, ctx->entries_data_count);
 	*list = data;
 	return 0;
 }
 
-static int internal_has_keys(const char *pid, const char **keys, int count)
+static int internal_has_keys(int dirfd, const char **keys, int count)
 {
 	int i, result;
 
-	result = ensure_mount_point();
-	if (result < 0)
-		return result;
-
-	result = set_pid_path(pid);
-	if (result < 0)
-		return result;
+	if (dirfd < 0)
+		return dirfd;
 
 	for (i = 0 ; i < count ; i++) {
-		result = set_key_path(keys[i]);
-		if (result < 0)
-			return result;
-
-		result = access(mountpoint, F_OK);
+		result = faccessat(dirfd, keys[i], F_OK, 0);
 		if (result < 0)
 			return -errno;
 	}
@@ -340,41 +680,236 @@ static int internal_has_keys(const char *pid, const char **keys, int count)
 	return 0;
 }
 
+/*
+write to 'queryfd' the query of the 'count' 'keys', one key per line.
+when 'failfast', a leading empty line asks to skip the keys after a failure.
+*/
+static int query_write(int queryfd, const char **keys, int count, int failfast)
+{
+	char *buffer, *p;
+	size_t length;
+	ssize_t rc;
+	int i;
 
+	length = failfast ? 1 : 0;
+	for (i = 0 ; i < count ; i++) {
+		if (!keys[i][0] || strchr(keys[i], '\n'))
+			return -EINVAL;
+		length += strlen(keys[i]) + 1;
+	}
+	buffer = malloc(length);
+	if (!buffer)
+		return -ENOMEM;
+	p = buffer;
+	if (failfast)
+		*p++ = '\n';
+	for (i = 0 ; i < count ; i++) {
+		p = stpcpy(p, keys[i]);
+		*p++ = '\n';
+	}
 
+	p = buffer;
+	while (length) {
+		rc = write(queryfd, p, length);
+		if (rc < 0) {
+			if (errno == EINTR)
+				continue;
+			free(buffer);
+			return -errno;
+		}
+		p += rc;
+		length -= (size_t)rc;
+	}
+	free(buffer);
+	return 0;
+}
 
+/* translate the 'count' 'verdicts' to 'results', returns the count of granted */
+static int query_results(const char *verdicts, int count, int *results)
+{
+	int i, granted;
 
+	granted = 0;
+	for (i = 0 ; i < count ; i++) {
+		switch (verdicts[i]) {
+		case 'Y': results[i] = 0; granted++; break;
+		case 'N': results[i] = -EPERM; break;
+		case 'X': results[i] = -ENOENT; break;
+		case 'E': results[i] = -EIO; break;
+		case 'S': results[i] = -ECANCELED; break;
+		default: results[i] = -EAGAIN; break;
+		}
+	}
+	return granted;
+}
 
+/* check the keys through the query file 'queryfd' */
+static int internal_query_keys(int queryfd, const char **keys, int count, int *results, int failfast)
+{
+	char verdicts[KEYZEN_QUERY_MAX];
+	ssize_t rc;
+	int n, granted;
 
+	granted = 0;
+	while (count) {
+		n = count < KEYZEN_QUERY_MAX ? count : KEYZEN_QUERY_MAX;
 
+		rc = query_write(queryfd, keys, n, failfast);
+		if (rc < 0)
+			return (int)rc;
+		do {
+			rc = read(queryfd, verdicts, sizeof verdicts);
+		} while (rc < 0 && errno == EINTR);
+		if (rc < 0)
+			return -errno;
+		if (rc != n)
+			return -EIO;
+
+		rc = query_results(verdicts, n, results);
+		granted += (int)rc;
+		keys += n;
+		results += n;
+		count -= n;
+		if (failfast && rc < n) {
+			/* the remaining keys are skipped */
+			while (count--)
+				*results++ = -ECANCELED;
+			break;
+		}
+	}
 
+	return granted;
+}
 
+/*
+check the keys of 'pid', in one query when possible.
+when 'failfast', the keys after a failure get -ECANCELED.
+returns the count of granted keys or a negative code on failure.
+*/
+static int internal_check_keys(keyzen_ctx *ctx, pid_t pid, const char **keys, int count, int *results, int failfast)
+{
+	int i, fd, granted;
+
+	fd = count > 1 ? get_pid_queryfd(ctx, pid) : -ENOTSUP;
+	if (fd >= 0) {
+		granted = internal_query_keys(fd, keys, count, results, failfast);
+		if (granted < 0)
+			drop_pid_queryfd(ctx, pid);
+		return granted;
+	}
+	if (fd != -ENOTSUP)
+		return fd;
 
+	fd = get_pid_dirfd(ctx, pid);
+	if (fd < 0)
+		return fd;
 
-static int internal_add_key(const char *key)
+	granted = 0;
+	for (i = 0 ; i < count ; i++) {
+		if (failfast && granted < i)
+			results[i] = -ECANCELED;
+		else
+			results[i] = faccessat(fd, keys[i], F_OK, 0) < 0 ? -errno : 0;
+		if (!results[i])
+			granted++;
+	}
+	return granted;
+}
+
+/* check the keys of 'pid' and returns the first failure */
+static int internal_process_has_keys(keyzen_ctx *ctx, pid_t pid, const char **keys, int count)
 {
-	int result;
+	int stack[32], *results, i, result;
 
-	result = set_key_path(key);
-	if (result < 0)
-		return result;
+	results = count <= 32 ? stack : malloc((size_t)count * sizeof * results);
+	if (!results)
+		return -ENOMEM;
+
+	result = internal_check_keys(ctx, pid, keys, count, results, 1);
+	for (i = 0 ; result >= 0 && i < count ; i++)
+		if (results[i] < 0)
+			result = results[i];
+
+	if (results != stack)
+		free(results);
+	return result < 0 ? result : 0;
+}
+
+/*
+change the keys of the current process by one transaction writing
+the line 'op' sp key for each of the 'count' 'keys'
+*/
+static int internal_update_keys(keyzen_ctx *ctx, char op, const char **keys, int count)
+{
+	char *buffer, *p;
+	size_t length;
+	ssize_t rc;
+	int i, fd;
+
+	fd = get_self_updatefd(ctx);
+	if (fd < 0)
+		return fd;
 
-	result = mknod(mountpoint, S_IFREG, 0);
+	length = 3;
+	for (i = 0 ; i < count ; i++) {
+		if (!keys[i][0] || strchr(keys[i], '\n'))
+			return -EINVAL;
+		length += strlen(keys[i]) + 3;
+	}
+	buffer = malloc(length);
+	if (!buffer)
+		return -ENOMEM;
+
+	p = buffer;
+	for (i = 0 ; i < count ; i++) {
+		*p++ = op;
+		*p++ = ' ';
+		p = stpcpy(p, keys[i]);
+		*p++ = '\n';
+	}
+	if (!count) {
+		/* the empty set */
+		*p++ = op;
+		*p++ = '\n';
+	}
+	*p++ = '\n';
+	length = (size_t)(p - buffer);
+
+	p = buffer;
+	while (length) {
+		rc = write(fd, p, length);
+		if (rc < 0) {
+			if (errno == EINTR)
+				continue;
+			rc = -errno;
+			free(buffer);
+			close(fd);
+			ctx->updatefd = -1;
+			return (int)rc;
+		}
+		p += rc;
+		length -= (size_t)rc;
+	}
+	free(buffer);
+	return 0;
+}
+
+static int internal_add_key(int dirfd, const char *key)
+{
+	int result;
+
+	result = mknodat(dirfd, key, S_IFREG, 0);
 	if (result < 0 && errno != EEXIST)
 		return -errno;
 
 	return 0;
 }
 
-static int internal_drop_key(const char *key)
+static int internal_drop_key(int dirfd, const char *key)
 {
 	int result;
 
-	result = set_key_path(key);
-	if (result < 0)
-		return result;
-
-	result = unlink(mountpoint);
+	result = unlinkat(dirfd, key, 0);
 	if (result < 0 && errno != ENOENT)
 		return -errno;
 
@@ -386,51 +921,556 @@ static int internal_drop_key(const char *key)
 
 
 
-int keyzen_process_has_keys(pid_t pid, const char **keys, int count)
+/* get the monotonic time in ms */
+static long long now_ms()
 {
-	return internal_has_keys(pidstr(pid), keys, count);
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
 }
 
-int keyzen_process_list_keys(pid_t pid, void **list)
+static unsigned cache_hash(pid_t pid, const char *key)
 {
-	return internal_export_list_keys(pidstr(pid), list);
+	unsigned h = (unsigned)pid;
+
+	while (*key)
+		h = h * 31 + (unsigned char)*key++;
+	return h & (CACHE_SIZE - 1);
 }
 
-int keyzen_self_has_keys(const char **keys, int count)
+static void cache_clear(struct cache *cache)
+{
+	int i;
+	struct verdict *v;
+	struct generation *g;
+
+	for (i = 0 ; i < CACHE_SIZE ; i++) {
+		while ((v = cache->verdicts[i])) {
+			cache->verdicts[i] = v->next;
+			free(v);
+		}
+		while ((g = cache->generations[i])) {
+			cache->generations[i] = g->next;
+			free(g);
+		}
+	}
+	cache->count = 0;
+}
+
+/*
+read the extended attribute 'name' of the entry 'key' of 'pid' as a string.
+the O_PATH directory of 'pid' can't be given to fgetxattr, its link in
+/proc/self/fd is used instead of walking the path of the mount.
+*/
+static int cache_getxattr(keyzen_ctx *ctx, pid_t pid, const char *key, const char *name, char *value, size_t size)
 {
-	return internal_has_keys(self, keys, count);
+	char path[PATH_MAX];
+	ssize_t length;
+	int n, dirfd;
+
+	dirfd = get_pid_dirfd(ctx, pid);
+	if (dirfd < 0)
+		return dirfd;
+	n = snprintf(path, sizeof path, "/proc/self/fd/%d%s%s", dirfd, key ? "/" : "", key ? key : "");
+	if (n < 0 || n >= (int)sizeof path)
+		return -ENAMETOOLONG;
+
+	length = getxattr(path, name, value, size - 1);
+	if (length < 0)
+		return -errno;
+	value[length] = 0;
+	return 0;
 }
 
-int keyzen_self_add_keys(const char **keys, int count)
+/*
+get the generation of 'pid', reading it again from the filesystem
+when older than the ttl. returns 0 when the generation is unknown.
+*/
+static struct generation *cache_generation(keyzen_ctx *ctx, pid_t pid)
 {
-	int i, result;
+	char buffer[30], *end;
+	unsigned long value;
+	long long now;
+	struct generation *g, **prv;
 
-	result = ensure_mount_point();
-	if (result < 0)
-		return result;
+	prv = &ctx->cache->generations[cache_hash(pid, "")];
+	g = *prv;
+	while (g && g->pid != pid)
+		g = g->next;
 
-	result = set_pid_path(self);
-	if (result < 0)
+	now = now_ms();
+	if (g && now < g->expire)
+		return g;
+
+	if (cache_getxattr(ctx, pid, 0, KEYZEN_XATTR_GENERATION, buffer, sizeof buffer) < 0)
+		return 0;
+	value = strtoul(buffer, &end, 10);
+	if (end == buffer || *end)
+		return 0;
+
+	if (!g) {
+		if (ctx->cache->count >= CACHE_MAX)
+			cache_clear(ctx->cache);
+		g = malloc(sizeof * g);
+		if (!g)
+			return 0;
+		g->pid = pid;
+		g->next = *prv;
+		*prv = g;
+		ctx->cache->count++;
+	}
+	g->value = value;
+	g->expire = now + ctx->cache_ttl;
+	return g;
+}
+
+/*
+record the 'status' of 'key' for 'pid' at 'generation' if it can't
+change without changing the generation: the permitted keys and the
+missing keys, never the keys of prompt.
+*/
+static void cache_put(keyzen_ctx *ctx, pid_t pid, const char *key, unsigned long generation, int status)
+{
+	char mode[4];
+	size_t length;
+	struct verdict *v, **prv;
+
+	if (status == 0) {
+		if (cache_getxattr(ctx, pid, key, KEYZEN_XATTR_MODE, mode, sizeof mode) < 0
+		 || strcmp(mode, "="))
+			return;
+	} else if (status != -ENOENT)
+		return;
+
+	prv = &ctx->cache->verdicts[cache_hash(pid, key)];
+	v = *prv;
+	while (v && (v->pid != pid || strcmp(v->key, key)))
+		v = v->next;
+
+	if (!v) {
+		if (ctx->cache->count >= CACHE_MAX) {
+			cache_clear(ctx->cache);
+			return;
+		}
+		length = strlen(key);
+		v = malloc(sizeof * v + length);
+		if (!v)
+			return;
+		v->pid = pid;
+		memcpy(v->key, key, length + 1);
+		v->next = *prv;
+		*prv = v;
+		ctx->cache->count++;
+	}
+	v->generation = generation;
+	v->status = status;
+}
+
+static struct verdict *cache_get(keyzen_ctx *ctx, pid_t pid, const char *key, unsigned long generation)
+{
+	struct verdict *v;
+
+	v = ctx->cache->verdicts[cache_hash(pid, key)];
+	while (v && (v->pid != pid || strcmp(v->key, key)))
+		v = v->next;
+
+	return v && v->generation == generation ? v : 0;
+}
+
+static int cached_has_keys(keyzen_ctx *ctx, pid_t pid, const char **keys, int count)
+{
+	int i, n, result, stack[32], *results;
+	const char *stackmissing[32], **missing;
+	unsigned long generation;
+	struct generation *g;
+	struct verdict *v;
+
+	g = cache_generation(ctx, pid);
+	if (!g)
+		return internal_process_has_keys(ctx, pid, keys, count);
+	generation = g->value;
+
+	if (count <= 32) {
+		results = stack;
+		missing = stackmissing;
+	} else {
+		missing = malloc((size_t)count * (sizeof * missing + sizeof * results));
+		if (!missing)
+			return -ENOMEM;
+		results = (int *)(missing + count);
+	}
+
+	/* the cached verdicts */
+	result = 0;
+	for (i = n = 0 ; !result && i < count ; i++) {
+		v = cache_get(ctx, pid, keys[i], generation);
+		if (!v)
+			missing[n++] = keys[i];
+		else if (v->status < 0)
+			result = v->status;
+	}
+
+	/* check the others */
+	if (!result && n) {
+		result = internal_check_keys(ctx, pid, missing, n, results, 1);
+		for (i = 0 ; result >= 0 && i < n ; i++) {
+			cache_put(ctx, pid, missing[i], generation, results[i]);
+			if (results[i] < 0)
+				result = results[i];
+		}
+	}
+
+	if (missing != stackmissing)
+		free(missing);
+	return result < 0 ? result : 0;
+}
+
+/* map the snapshot whose path is given by the root of the mount */
+static const struct keyzen_snapshot_header *snapshot_map(keyzen_ctx *ctx)
+{
+	char path[PATH_MAX];
+	const struct keyzen_snapshot_header *h;
+	struct stat st;
+	ssize_t length;
+	void *map;
+	int fd;
+
+	if (ensure_mount_point(ctx) < 0)
+		return 0;
+	length = getxattr(ctx->mountpoint, KEYZEN_XATTR_SNAPSHOT, path, sizeof path - 1);
+	if (length <= 0)
+		return 0;
+	path[length] = 0;
+
+	/* only a file that keyzen-fs alone can write */
+	fd = open(path, O_RDONLY|O_CLOEXEC);
+	if (fd < 0)
+		return 0;
+	map = MAP_FAILED;
+	if (!fstat(fd, &st) && S_ISREG(st.st_mode) && !(st.st_mode & (S_IWGRP|S_IWOTH))
+	 && (st.st_uid == 0 || st.st_uid == geteuid())
+	 && st.st_size >= (off_t)sizeof * h)
+		map = mmap(0, KEYZEN_SNAPSHOT_MAX, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return 0;
+
+	h = map;
+	if (__atomic_load_n(&h->magic, __ATOMIC_ACQUIRE) != KEYZEN_SNAPSHOT_MAGIC
+	 || h->version != KEYZEN_SNAPSHOT_VERSION) {
+		munmap(map, KEYZEN_SNAPSHOT_MAX);
+		return 0;
+	}
+	return h;
+}
+
+/* map the snapshot on the first call */
+static void snapshot_attach(keyzen_ctx *ctx)
+{
+	if (!__atomic_load_n(&snapshot_tried, __ATOMIC_ACQUIRE)) {
+		pthread_mutex_lock(&snapshot_mutex);
+		if (!snapshot_tried) {
+			__atomic_store_n(&snapshot, snapshot_map(ctx), __ATOMIC_SEQ_CST);
+			__atomic_store_n(&snapshot_tried, 1, __ATOMIC_RELEASE);
+		}
+		pthread_mutex_unlock(&snapshot_mutex);
+	}
+}
+
+/*
+unmap the retired mappings if no thread reads the snapshot. the readers
+count themselves before getting the mapping, so the ones coming after
+can't get a retired mapping. must be called with the mutex locked.
+*/
+static void snapshot_unmap_retired()
+{
+	struct snapshot_mapping *m;
+
+	if (__atomic_load_n(&snapshot_readers, __ATOMIC_SEQ_CST))
+		return;
+	while ((m = snapshot_retired)) {
+		__atomic_store_n(&snapshot_retired, m->next, __ATOMIC_RELAXED);
+		munmap((void*)m->header, KEYZEN_SNAPSHOT_MAX);
+		free(m);
+	}
+}
+
+/* forget the snapshot for mapping it again */
+static void snapshot_forget()
+{
+	struct snapshot_mapping *m;
+	const struct keyzen_snapshot_header *h;
+
+	pthread_mutex_lock(&snapshot_mutex);
+	h = snapshot;
+	__atomic_store_n(&snapshot, 0, __ATOMIC_SEQ_CST);
+	__atomic_store_n(&snapshot_tried, 0, __ATOMIC_RELEASE);
+	if (h) {
+		m = malloc(sizeof * m);
+		if (m) {
+			/* without memory, the mapping is left */
+			m->header = h;
+			m->next = snapshot_retired;
+			__atomic_store_n(&snapshot_retired, m, __ATOMIC_RELAXED);
+		}
+	}
+	snapshot_unmap_retired();
+	pthread_mutex_unlock(&snapshot_mutex);
+}
+
+/* the calling thread starts reading the snapshot */
+static const struct keyzen_snapshot_header *snapshot_enter()
+{
+	__atomic_add_fetch(&snapshot_readers, 1, __ATOMIC_SEQ_CST);
+	return __atomic_load_n(&snapshot, __ATOMIC_SEQ_CST);
+}
+
+/* the calling thread stops reading the snapshot */
+static void snapshot_leave()
+{
+	if (!__atomic_sub_fetch(&snapshot_readers, 1, __ATOMIC_ACQ_REL)
+	 && __atomic_load_n(&snapshot_retired, __ATOMIC_RELAXED)) {
+		pthread_mutex_lock(&snapshot_mutex);
+		snapshot_unmap_retired();
+		pthread_mutex_unlock(&snapshot_mutex);
+	}
+}
+
+/* get the start time of the process 'pid' or 0 when unknown */
+static uint64_t process_start(pid_t pid)
+{
+	char buffer[1024], *p;
+	uint64_t result;
+	ssize_t length;
+	int fd, i;
+
+	snprintf(buffer, sizeof buffer, "/proc/%d/stat", (int)pid);
+	fd = open(buffer, O_RDONLY|O_CLOEXEC);
+	if (fd < 0)
+		return 0;
+	length = read(fd, buffer, sizeof buffer - 1);
+	close(fd);
+	if (length <= 0)
+		return 0;
+	buffer[length] = 0;
+
+	/* the state follows the name, the start is the 20th field after it */
+	p = strrchr(buffer, ')');
+	if (!p || p[1] != ' ' || p[2] == 'Z' || p[2] == 'X')
+		return 0;
+	for (i = 0 ; p && i < 20 ; i++)
+		p = strchr(p + 1, ' ');
+	if (!p)
+		return 0;
+	result = strtoull(p + 1, &p, 10);
+	return *p == ' ' ? result : 0;
+}
+
+static void self_start_forget()
+{
+	self_start_pid = 0;
+}
+
+static void self_start_init()
+{
+	pthread_atfork(0, 0, self_start_forget);
+}
+
+/*
+get the start time of 'pid', read once for the calling process. the
+start of the other pids is kept by 'ctx' and used when 'cached': it is
+valid while the row matches and keyzen-fs drops the rows at exit.
+*/
+static uint64_t snapshot_start_of(keyzen_ctx *ctx, pid_t pid, int cached)
+{
+	uint64_t start;
+	int i;
+
+	if (pid == __atomic_load_n(&self_start_pid, __ATOMIC_ACQUIRE))
+		return self_start;
+
+	i = (int)pid & (STARTS_COUNT - 1);
+	if (cached && ctx->starts[i].pid == pid)
+		return ctx->starts[i].start;
+
+	start = process_start(pid);
+	if (start && pid == getpid()) {
+		pthread_once(&self_start_once, self_start_init);
+		self_start = start;
+		__atomic_store_n(&self_start_pid, pid, __ATOMIC_RELEASE);
+	} else {
+		ctx->starts[i].pid = start ? pid : 0;
+		ctx->starts[i].start = start;
+	}
+	return start;
+}
+
+/*
+search the key 'name' of 'length' in the snapshot 'h' of 'size'.
+returns its kid, -ENOENT when missing or -EAGAIN when inconsistent.
+*/
+static int snapshot_kid(const struct keyzen_snapshot_header *h, uint32_t size, const char *name, uint32_t length)
+{
+	const struct keyzen_snapshot_key *keys, *key;
+	const char *names;
+	uint32_t l, u, i;
+	int d;
+
+	keys = (const void*)((const char*)h + h->keys_offset);
+	names = (const char*)h + h->names_offset;
+	l = 0;
+	u = h->key_count;
+	while (l < u) {
+		i = (l + u) >> 1;
+		key = &keys[i];
+		if ((uint64_t)h->names_offset + key->offset + key->length > size)
+			return -EAGAIN;
+		d = memcmp(name, names + key->offset, length < key->length ? length : key->length);
+		if (!d)
+			d = (length > key->length) - (length < key->length);
+		if (!d)
+			return (int)key->kid;
+		if (d < 0)
+			u = i;
+		else
+			l = i + 1;
+	}
+	return -ENOENT;
+}
+
+#define SNAPSHOT_OTHER	2	/* the row is of another start of the pid */
+
+/* read the verdict of the 'keys' of 'pid' started at 'start' in the snapshot 'h' */
+static int snapshot_read(const struct keyzen_snapshot_header *h, pid_t pid, uint64_t start, const char **keys, int count)
+{
+	const uint32_t *pids;
+	const char *row;
+	uint32_t size, index;
+	size_t length;
+	int i, kid;
+	char mode;
+
+	size = h->size;
+	if (size > KEYZEN_SNAPSHOT_MAX || (uint32_t)pid >= h->pid_count
+	 || (uint64_t)h->pids_offset + (uint64_t)h->pid_count * sizeof * pids > size
+	 || (uint64_t)h->keys_offset + (uint64_t)h->key_count * sizeof(struct keyzen_snapshot_key) > size)
+		return 1;
+
+	pids = (const void*)((const char*)h + h->pids_offset);
+	index = pids[pid];
+	if (!index || (uint64_t)h->rows_offset + (uint64_t)index * h->row_size > size
+	 || (uint64_t)h->starts_offset + (uint64_t)index * sizeof start > size)
+		return 1;
+
+	/* a row left by a previous process of the same pid or a start cached before */
+	if (((const uint64_t*)((const char*)h + h->starts_offset))[index - 1] != start)
+		return SNAPSHOT_OTHER;
+	row = (const char*)h + h->rows_offset + (size_t)(index - 1) * h->row_size;
+
+	for (i = 0 ; i < count ; i++) {
+		/* names that aren't keys are left to keyzen-fs */
+		if (!keys[i][0] || keys[i][0] == '.' || strchr(keys[i], '/'))
+			return 1;
+		length = strlen(keys[i]);
+		kid = length > UINT32_MAX ? -ENOENT : snapshot_kid(h, size, keys[i], (uint32_t)length);
+		if (kid == -EAGAIN || (kid >= 0 && (uint32_t)kid >= h->row_size))
+			return 1;
+		mode = kid < 0 ? 0 : row[kid];
+		if (!mode)
+			return -ENOENT;
+		if (mode != '=')
+			return 1; /* needs a decision */
+	}
+	return 0;
+}
+
+/* read the verdict of the 'keys' of 'pid' in a consistent state of the snapshot 'h' */
+static int snapshot_scan(const struct keyzen_snapshot_header *h, pid_t pid, uint64_t start, const char **keys, int count)
+{
+	uint32_t seq;
+	int retry, verdict;
+
+	for (retry = 0 ; retry < SNAPSHOT_RETRY ; retry++) {
+		seq = __atomic_load_n(&h->seq, __ATOMIC_ACQUIRE);
+		if (seq & 1)
+			continue;
+		if (h->state != KEYZEN_SNAPSHOT_ALIVE) {
+			if (h->state == KEYZEN_SNAPSHOT_CLOSED)
+				snapshot_forget();
+			break;
+		}
+		verdict = snapshot_read(h, pid, start, keys, count);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&h->seq, __ATOMIC_RELAXED) == seq)
+			return verdict;
+	}
+	return 1;
+}
+
+/*
+check the 'keys' of 'pid' using the snapshot. when keyzen-fs drops the
+rows at exit, the start of 'pid' is cached by 'ctx' and the check is
+made without system call, else only the calling process is checked
+without system call.
+returns 0 when all the keys are permitted, the failure of the first key
+that isn't permitted or 1 when keyzen-fs must be asked.
+*/
+static int snapshot_has_keys(keyzen_ctx *ctx, pid_t pid, const char **keys, int count)
+{
+	const struct keyzen_snapshot_header *h;
+	uint64_t start;
+	int result, cached;
+
+	if (pid <= 0 || !__atomic_load_n(&snapshot, __ATOMIC_RELAXED))
+		return 1;
+
+	result = 1;
+	h = snapshot_enter();
+	if (h) {
+		cached = (__atomic_load_n(&h->flags, __ATOMIC_ACQUIRE) & KEYZEN_SNAPSHOT_EXITS) != 0;
+		start = snapshot_start_of(ctx, pid, cached);
+		result = start ? snapshot_scan(h, pid, start, keys, count) : 1;
+		if (result == SNAPSHOT_OTHER && cached) {
+			/* the pid started again since cached */
+			start = snapshot_start_of(ctx, pid, 0);
+			result = start ? snapshot_scan(h, pid, start, keys, count) : 1;
+		}
+	}
+	snapshot_leave();
+	return result == SNAPSHOT_OTHER ? 1 : result;
+}
+
+static int internal_self_add_keys(keyzen_ctx *ctx, const char **keys, int count)
+{
+	int i, result, dirfd;
+
+	result = count ? internal_update_keys(ctx, 'a', keys, count) : 0;
+	if (result != -ENOTSUP)
 		return result;
 
+	dirfd = get_self_dirfd(ctx);
+	if (dirfd < 0)
+		return dirfd;
+
 	result = 0;
 	for (i = 0 ; !result && i < count ; i++)
-		result = internal_add_key(keys[i]);
+		result = internal_add_key(dirfd, keys[i]);
 
 	return result;
 }
 
-int keyzen_self_drop_keys(const char **keys, int count)
+static int internal_self_drop_keys(keyzen_ctx *ctx, const char **keys, int count)
 {
-	int i, result, dropadmin;
+	int i, result, dropadmin, dirfd;
 
-	result = ensure_mount_point();
-	if (result < 0)
+	result = count ? internal_update_keys(ctx, 'd', keys, count) : 0;
+	if (result != -ENOTSUP)
 		return result;
 
-	result = set_pid_path(self);
-	if (result < 0)
-		return result;
+	dirfd = get_self_dirfd(ctx);
+	if (dirfd < 0)
+		return dirfd;
 
 	result = 0;
 	dropadmin = 0;
@@ -438,55 +1478,435 @@ int keyzen_self_drop_keys(const char **keys, int count)
 		if (!strcmp(keys[i], adminkey)) {
 			dropadmin = 1;
 		} else {
-			result = internal_drop_key(keys[i]);
+			result = internal_drop_key(dirfd, keys[i]);
 		}
 	}
 
 	if (!result && dropadmin)
-		result = internal_drop_key(adminkey);
+		result = internal_drop_key(dirfd, adminkey);
 		
 	return result;
 }
 
-int keyzen_self_set_keys(const char **keys, int count)
+static int internal_self_set_keys(keyzen_ctx *ctx, const char **keys, int count)
 {
-	int i, result, dropadmin;
+	int i, result, dropadmin, dirfd;
 
-	result = internal_list_keys(self);
+	result = internal_update_keys(ctx, 's', keys, count);
+	if (result != -ENOTSUP)
+		return result;
+
+	dirfd = get_self_dirfd(ctx);
+	result = internal_list_keys(ctx, dirfd);
 	if (result < 0)
 		return result;
 
 	/* mark the entries to keep */
 	for (i = 0 ; i < count ; i++) {
-		result = get_entry(keys[i], 1, 0);
+		result = get_entry(ctx, keys[i], 1, 0);
 		if (result < 0)
 			return result;
 
-		entries_array[result].flag |= FLAG_KEEP;
+		ctx->entries_array[result].flag |= FLAG_KEEP;
 	}
 
 	result = 0;
 	dropadmin = 0;
-	for (i = 0 ; !result && i < entries_array_count ; i++) {
-		switch (entries_array[i].flag & (FLAG_KEEP|FLAG_EXIST)) {
+	for (i = 0 ; !result && i < ctx->entries_array_count ; i++) {
+		switch (ctx->entries_array[i].flag & (FLAG_KEEP|FLAG_EXIST)) {
 		case FLAG_EXIST:
-			if (!strcmp(entries_array[i].entry, adminkey)) {
+			if (!strcmp(ctx->entries_array[i].entry, adminkey)) {
 				dropadmin = 1;
 			} else {
-				result = internal_drop_key(entries_array[i].entry);
+				result = internal_drop_key(dirfd, ctx->entries_array[i].entry);
 			}
 			break;
 		case FLAG_KEEP:
-			result = internal_add_key(entries_array[i].entry);
+			result = internal_add_key(dirfd, ctx->entries_array[i].entry);
 			break;
 		}
 	}
 	if (!result && dropadmin)
-		result = internal_drop_key(adminkey);
+		result = internal_drop_key(dirfd, adminkey);
 		
 	return result;
 }
 
+keyzen_ctx *keyzen_ctx_create()
+{
+	return calloc(1, sizeof(keyzen_ctx));
+}
+
+void keyzen_ctx_destroy(keyzen_ctx *ctx)
+{
+	if (ctx) {
+		if (ctx->owner == getpid())
+			close_dirfds(ctx);
+		if (ctx->cache) {
+			cache_clear(ctx->cache);
+			free(ctx->cache);
+		}
+		free(ctx->entries_array);
+		free(ctx->entries_data);
+		free(ctx);
+	}
+}
+
+static void thread_ctx_destroy(void *ctx)
+{
+	keyzen_ctx_destroy(ctx);
+}
+
+static void thread_ctx_init()
+{
+	pthread_key_create(&thread_ctx_key, thread_ctx_destroy);
+}
+
+/* get the context of the current thread */
+static keyzen_ctx *get_thread_ctx()
+{
+	if (!thread_ctx) {
+		pthread_once(&thread_ctx_once, thread_ctx_init);
+		thread_ctx = keyzen_ctx_create();
+		if (thread_ctx)
+			pthread_setspecific(thread_ctx_key, thread_ctx);
+	}
+	return thread_ctx;
+}
+
+int keyzen_ctx_cache_verdicts(keyzen_ctx *ctx, int ttl)
+{
+	if (ttl <= 0) {
+		if (ctx->cache) {
+			cache_clear(ctx->cache);
+			free(ctx->cache);
+			ctx->cache = 0;
+		}
+		ttl = 0;
+	} else if (!ctx->cache) {
+		ctx->cache = calloc(1, sizeof * ctx->cache);
+		if (!ctx->cache)
+			return -ENOMEM;
+	}
+	ctx->cache_ttl = ttl;
+	return 0;
+}
+
+/* forget the mount when keyzen-fs is gone */
+static int checked(keyzen_ctx *ctx, int result)
+{
+	if (result == -ENOTCONN) {
+		close_dirfds(ctx);
+		forget_mount_point(ctx);
+		snapshot_forget();
+	}
+	return result;
+}
+
+int keyzen_ctx_process_has_keys(keyzen_ctx *ctx, pid_t pid, const char **keys, int count)
+{
+	int result;
+
+	snapshot_attach(ctx);
+	result = snapshot_has_keys(ctx, pid, keys, count);
+	if (result <= 0)
+		return result;
+
+	if (ctx->cache)
+		return checked(ctx, cached_has_keys(ctx, pid, keys, count));
+	return checked(ctx, internal_process_has_keys(ctx, pid, keys, count));
+}
+
+int keyzen_ctx_process_check_keys(keyzen_ctx *ctx, pid_t pid, const char **keys, int count, int *results)
+{
+	return checked(ctx, internal_check_keys(ctx, pid, keys, count, results, 0));
+}
+
+int keyzen_ctx_process_list_keys(keyzen_ctx *ctx, pid_t pid, void **list)
+{
+	return checked(ctx, internal_export_list_keys(ctx, get_pid_dirfd(ctx, pid), list));
+}
+
+int keyzen_ctx_self_has_keys(keyzen_ctx *ctx, const char **keys, int count)
+{
+	return checked(ctx, internal_has_keys(get_self_dirfd(ctx), keys, count));
+}
+
+int keyzen_ctx_self_add_keys(keyzen_ctx *ctx, const char **keys, int count)
+{
+	return checked(ctx, internal_self_add_keys(ctx, keys, count));
+}
+
+int keyzen_ctx_self_drop_keys(keyzen_ctx *ctx, const char **keys, int count)
+{
+	return checked(ctx, internal_self_drop_keys(ctx, keys, count));
+}
+
+int keyzen_ctx_self_set_keys(keyzen_ctx *ctx, const char **keys, int count)
+{
+	return checked(ctx, internal_self_set_keys(ctx, keys, count));
+}
+
+int keyzen_ctx_self_list_keys(keyzen_ctx *ctx, void **list)
+{
+	return checked(ctx, internal_export_list_keys(ctx, get_self_dirfd(ctx), list));
+}
+
+
+/* queue the 'check' as completed with 'status' */
+static void batch_complete(keyzen_batch *batch, struct batch_check *check, int status)
+{
+	uint64_t one = 1;
+
+	check->status = status;
+	check->next = 0;
+	if (batch->done_last)
+		batch->done_last->next = check;
+	else {
+		batch->done_first = check;
+		if (write(batch->evfd, &one, sizeof one) < 0)
+			assert(errno == EAGAIN);
+	}
+	batch->done_last = check;
+}
+
+/* receive the verdicts of the pending 'check' */
+static void batch_receive(keyzen_batch *batch, struct batch_check *check)
+{
+	char verdicts[KEYZEN_QUERY_MAX];
+	int results[KEYZEN_QUERY_MAX], i, status;
+	ssize_t rc;
+
+	do {
+		rc = read(check->fd, verdicts, sizeof verdicts);
+	} while (rc < 0 && errno == EINTR);
+
+	/* keys still deciding: wait for the notification of the verdicts */
+	if (rc > 0 && rc == check->count && memchr(verdicts, '?', (size_t)rc))
+		return;
+
+	if (rc < 0)
+		status = -errno;
+	else if (rc != check->count)
+		status = -EIO;
+	else {
+		status = 0;
+		query_results(verdicts, check->count, results);
+		for (i = 0 ; !status && i < check->count ; i++)
+			status = results[i];
+	}
+
+	epoll_ctl(batch->epfd, EPOLL_CTL_DEL, check->fd, 0);
+	close(check->fd);
+	check->fd = -1;
+	if (check->prev)
+		check->prev->next = check->next;
+	else
+		batch->pending = check->next;
+	if (check->next)
+		check->next->prev = check->prev;
+	batch_complete(batch, check, checked(batch->ctx, status));
+}
+
+keyzen_batch *keyzen_batch_create()
+{
+	struct epoll_event ev;
+	keyzen_batch *batch;
+
+	batch = calloc(1, sizeof * batch);
+	if (!batch)
+		return 0;
+
+	batch->ctx = keyzen_ctx_create();
+	batch->epfd = epoll_create1(EPOLL_CLOEXEC);
+	batch->evfd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+	ev.events = EPOLLIN;
+	ev.data.ptr = 0;
+	if (!batch->ctx || batch->epfd < 0 || batch->evfd < 0
+	 || epoll_ctl(batch->epfd, EPOLL_CTL_ADD, batch->evfd, &ev) < 0) {
+		keyzen_batch_destroy(batch);
+		return 0;
+	}
+	return batch;
+}
+
+void keyzen_batch_destroy(keyzen_batch *batch)
+{
+	struct batch_check *check;
+
+	if (batch) {
+		while ((check = batch->pending)) {
+			batch->pending = check->next;
+			close(check->fd);
+			free(check);
+		}
+		while ((check = batch->done_first)) {
+			batch->done_first = check->next;
+			free(check);
+		}
+		if (batch->epfd >= 0)
+			close(batch->epfd);
+		if (batch->evfd >= 0)
+			close(batch->evfd);
+		keyzen_ctx_destroy(batch->ctx);
+		free(batch);
+	}
+}
+
+int keyzen_batch_fd(keyzen_batch *batch)
+{
+	return batch->epfd;
+}
+
+int keyzen_batch_count(keyzen_batch *batch)
+{
+	return batch->count;
+}
+
+int keyzen_batch_submit(keyzen_batch *batch, pid_t pid, const char **keys, int count, void *closure)
+{
+	struct batch_check *check;
+	struct epoll_event ev;
+	int dirfd, fd, result;
+
+	if (count < 0 || count > KEYZEN_QUERY_MAX)
+		return -EINVAL;
+
+	check = malloc(sizeof * check);
+	if (!check)
+		return -ENOMEM;
+	check->count = count;
+	check->closure = closure;
+	check->fd = -1;
+	batch->count++;
+
+	/* the snapshot first */
+	snapshot_attach(batch->ctx);
+	result = count ? snapshot_has_keys(batch->ctx, pid, keys, count) : 0;
+	if (result > 0) {
+		/* then a query waiting for the verdicts */
+		dirfd = get_pid_dirfd(batch->ctx, pid);
+		fd = dirfd < 0 ? dirfd : openat(dirfd, query, O_RDWR|O_NONBLOCK|O_CLOEXEC);
+		if (fd >= 0) {
+			result = query_write(fd, keys, count, 1);
+			ev.events = EPOLLIN;
+			ev.data.ptr = check;
+			if (!result && epoll_ctl(batch->epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+				result = -errno;
+			if (!result) {
+				check->fd = fd;
+				check->prev = 0;
+				check->next = batch->pending;
+				if (check->next)
+					check->next->prev = check;
+				batch->pending = check;
+				return 0;
+			}
+			close(fd);
+		} else if (dirfd >= 0 && errno == ENOENT)
+			result = internal_process_has_keys(batch->ctx, pid, keys, count);
+		else
+			result = dirfd < 0 ? dirfd : -errno;
+	}
+
+	batch_complete(batch, check, checked(batch->ctx, result));
+	return 0;
+}
+
+int keyzen_batch_reap(keyzen_batch *batch, struct keyzen_completion *completions, int max, int timeout)
+{
+	struct epoll_event events[BATCH_EVENTS];
+	struct batch_check *check;
+	uint64_t value;
+	int i, n;
+
+	if (max <= 0)
+		return -EINVAL;
+
+	/* wait for completions */
+	if (!batch->done_first && batch->pending) {
+		n = epoll_wait(batch->epfd, events, max < BATCH_EVENTS ? max : BATCH_EVENTS, timeout);
+		if (n < 0)
+			return -errno;
+		for (i = 0 ; i < n ; i++)
+			if (events[i].data.ptr)
+				batch_receive(batch, events[i].data.ptr);
+	}
+
+	/* give the completed checks */
+	for (n = 0 ; n < max && batch->done_first ; n++) {
+		check = batch->done_first;
+		batch->done_first = check->next;
+		completions[n].closure = check->closure;
+		completions[n].status = check->status;
+		free(check);
+	}
+	if (!batch->done_first) {
+		batch->done_last = 0;
+		if (read(batch->evfd, &value, sizeof value) < 0)
+			assert(errno == EAGAIN);
+	}
+	batch->count -= n;
+	return n;
+}
+
+int keyzen_cache_verdicts(int ttl)
+{
+	__atomic_store_n(&thread_cache_ttl, ttl > 0 ? ttl : 0, __ATOMIC_RELAXED);
+	return 0;
+}
+
+int keyzen_process_has_keys(pid_t pid, const char **keys, int count)
+{
+	int ttl;
+	keyzen_ctx *ctx = get_thread_ctx();
+
+	if (!ctx)
+		return -ENOMEM;
+
+	ttl = __atomic_load_n(&thread_cache_ttl, __ATOMIC_RELAXED);
+	if (ttl != ctx->cache_ttl && keyzen_ctx_cache_verdicts(ctx, ttl) < 0)
+		return -ENOMEM;
+
+	return keyzen_ctx_process_has_keys(ctx, pid, keys, count);
+}
+
+int keyzen_process_check_keys(pid_t pid, const char **keys, int count, int *results)
+{
+	keyzen_ctx *ctx = get_thread_ctx();
+	return ctx ? keyzen_ctx_process_check_keys(ctx, pid, keys, count, results) : -ENOMEM;
+}
+
+int keyzen_process_list_keys(pid_t pid, void **list)
+{
+	keyzen_ctx *ctx = get_thread_ctx();
+	return ctx ? keyzen_ctx_process_list_keys(ctx, pid, list) : -ENOMEM;
+}
+
+int keyzen_self_has_keys(const char **keys, int count)
+{
+	keyzen_ctx *ctx = get_thread_ctx();
+	return ctx ? keyzen_ctx_self_has_keys(ctx, keys, count) : -ENOMEM;
+}
+
+int keyzen_self_add_keys(const char **keys, int count)
+{
+	keyzen_ctx *ctx = get_thread_ctx();
+	return ctx ? keyzen_ctx_self_add_keys(ctx, keys, count) : -ENOMEM;
+}
+
+int keyzen_self_drop_keys(const char **keys, int count)
+{
+	keyzen_ctx *ctx = get_thread_ctx();
+	return ctx ? keyzen_ctx_self_drop_keys(ctx, keys, count) : -ENOMEM;
+}
+
+int keyzen_self_set_keys(const char **keys, int count)
+{
+	keyzen_ctx *ctx = get_thread_ctx();
+	return ctx ? keyzen_ctx_self_set_keys(ctx, keys, count) : -ENOMEM;
+}
+
 
 int keyzen_process_has_key(pid_t pid, const char *key)
 {
@@ -516,7 +1936,8 @@ int keyzen_is_self_admin()
 
 int keyzen_self_list_keys(void **list)
 {
-	return internal_export_list_keys(self, list);
+	keyzen_ctx *ctx = get_thread_ctx();
+	return ctx ? keyzen_ctx_self_list_keys(ctx, list) : -ENOMEM;
 }
 
 int keyzen_list_keys_count(void *list)
@@ -9,9 +9,41 @@
  * Tests if the process of 'pid' is granted for all the 'count' 'keys'.
  *
  * Return 0 if the all keys are granted or a negative code on failure.
+ *
+ * The permitted and missing keys are read in the snapshot published
+ * by keyzen-fs, when available. The check is made without system call
+ * when keyzen-fs drops the rows of the processes at their exit, else
+ * only for the calling process: the other pids need a read of their
+ * /proc/PID/stat.
  */ 
 int keyzen_process_has_keys(pid_t pid, const char **keys, int count);
 
+/*
+ * Checks each of the 'count' 'keys' for the process of 'pid'.
+ * The keys are checked together by one query to keyzen-fs.
+ *
+ * Returns the count of granted keys or a negative code on failure.
+ *
+ * On success, the verdict of 'keys[i]' is stored in 'results[i]':
+ * 0 when granted or a negative code otherwise (-EPERM when denied,
+ * -ENOENT when the process doesn't have the key, -EIO when the
+ * check failed).
+ */
+int keyzen_process_check_keys(pid_t pid, const char **keys, int count, int *results);
+
+/*
+ * Enables the cache of the verdicts of `keyzen_process_has_keys`
+ * for all the threads. Only the permitted keys and the missing keys
+ * are cached, never the keys needing a prompt. The verdicts of a
+ * process are invalidated when its generation changes, what is
+ * checked at most once every 'ttl' milliseconds. So a change of the
+ * keys of a process can be seen until 'ttl' ms later. A 'ttl' of 0
+ * disables the cache (the default).
+ *
+ * Returns 0 on success or a negative code on failure.
+ */
+int keyzen_cache_verdicts(int ttl);
+
 /*
  * Gets the 'list' of keys possible for the process of 'pid'.
  *
@@ -124,5 +156,103 @@ const char *keyzen_list_keys_name(void *list, int index);
  */
 #define keyzen_list_keys_free(list) free(list)
 
+/*
+ * The functions above are using a context private to the
+ * calling thread. The functions below are using the given
+ * context 'ctx' instead. A context must not be used by
+ * two threads at the same time.
+ */
+typedef struct keyzen_ctx keyzen_ctx;
+
+/*
+ * Creates a new context.
+ *
+ * Returns the context or 0 when out of memory.
+ */
+keyzen_ctx *keyzen_ctx_create();
+
+/*
+ * Destroys the context 'ctx'.
+ */
+void keyzen_ctx_destroy(keyzen_ctx *ctx);
+
+/*
+ * Same as `keyzen_cache_verdicts` but only for the context 'ctx'.
+ */
+int keyzen_ctx_cache_verdicts(keyzen_ctx *ctx, int ttl);
+
+/*
+ * Same as the functions without context.
+ */
+int keyzen_ctx_process_has_keys(keyzen_ctx *ctx, pid_t pid, const char **keys, int count);
+int keyzen_ctx_process_check_keys(keyzen_ctx *ctx, pid_t pid, const char **keys, int count, int *results);
+int keyzen_ctx_process_list_keys(keyzen_ctx *ctx, pid_t pid, void **list);
+int keyzen_ctx_self_has_keys(keyzen_ctx *ctx, const char **keys, int count);
+int keyzen_ctx_self_add_keys(keyzen_ctx *ctx, const char **keys, int count);
+int keyzen_ctx_self_drop_keys(keyzen_ctx *ctx, const char **keys, int count);
+int keyzen_ctx_self_set_keys(keyzen_ctx *ctx, const char **keys, int count);
+int keyzen_ctx_self_list_keys(keyzen_ctx *ctx, void **list);
+
+/*
+ * A batch checks the keys of many processes at once. The checks
+ * needing a prompt are waiting together, each check is completed
+ * when its verdict is known. A batch must not be used by two threads
+ * at the same time.
+ */
+typedef struct keyzen_batch keyzen_batch;
+
+/*
+ * The completion of a check: the 'closure' given at submission and
+ * the 'status' as returned by `keyzen_process_has_keys`.
+ */
+struct keyzen_completion {
+	void *closure;
+	int status;
+};
+
+/*
+ * Creates a new batch.
+ *
+ * Returns the batch or 0 on failure.
+ */
+keyzen_batch *keyzen_batch_create();
+
+/*
+ * Destroys the 'batch', dropping its checks.
+ */
+void keyzen_batch_destroy(keyzen_batch *batch);
+
+/*
+ * Submits to the 'batch' the check of the 'count' 'keys' for the
+ * process of 'pid'. The 'closure' is given back at completion.
+ * The 'keys' aren't used after return. 'count' is at most
+ * KEYZEN_QUERY_MAX.
+ *
+ * Returns 0 on success or a negative code on failure. The failures
+ * of the check itself are given by its completion.
+ */
+int keyzen_batch_submit(keyzen_batch *batch, pid_t pid, const char **keys, int count, void *closure);
+
+/*
+ * Reaps at most 'max' completed checks of the 'batch' in 'completions',
+ * waiting at most 'timeout' milliseconds (-1 for ever, 0 for not
+ * waiting) when none is completed.
+ *
+ * Returns the count of reaped checks, 0 when none completed in time or
+ * none is pending, or a negative code on failure.
+ */
+int keyzen_batch_reap(keyzen_batch *batch, struct keyzen_completion *completions, int max, int timeout);
+
+/*
+ * Returns the count of the checks of the 'batch' not yet reaped.
+ */
+int keyzen_batch_count(keyzen_batch *batch);
+
+/*
+ * Returns a file descriptor of the 'batch' that polls readable when
+ * checks can be reaped, for the loops of events.
+ */
+int keyzen_batch_fd(keyzen_batch *batch);
+
 #endif
 
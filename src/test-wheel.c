@@ -0,0 +1,84 @@
+/* 2014, Copyright Intel & Jose Bollo <jose.bollo@open.eurogiciel.org>, license MIT */
+
+#include <stdio.h>
+#include <time.h>
+
+#include "wheel.h"
+
+static struct wheel_timer first, second, again;
+static int first_count = 0;
+static int second_count = 0;
+static int again_count = 0;
+static int failures = 0;
+
+#define CHECK(cond) \
+	do { if (!(cond)) { fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond); failures++; } } while (0)
+
+static void sleep_ms(int ms)
+{
+	struct timespec ts;
+
+	ts.tv_sec = ms / 1000;
+	ts.tv_nsec = (long)(ms % 1000) * 1000000;
+	while (nanosleep(&ts, &ts));
+}
+
+/* cancels the timer 'second' expiring in the same tick */
+static void first_expired(void *data)
+{
+	first_count++;
+	CHECK(wheel_is_armed(&second));
+	if (wheel_is_armed(&second))
+		wheel_remove(&second);
+}
+
+static void second_expired(void *data)
+{
+	second_count++;
+}
+
+/* arms itself again until the third time */
+static void again_expired(void *data)
+{
+	if (++again_count < 3)
+		wheel_add(&again, 0);
+}
+
+/* wait until no timer is armed */
+static void run_all()
+{
+	int timeout;
+
+	while ((timeout = wheel_timeout()) >= 0) {
+		sleep_ms(timeout);
+		wheel_run();
+	}
+}
+
+int main()
+{
+	wheel_init(10);
+	wheel_timer_init(&first, first_expired, 0);
+	wheel_timer_init(&second, second_expired, 0);
+	wheel_timer_init(&again, again_expired, 0);
+
+	/* the last added is run first */
+	wheel_add(&second, 20);
+	wheel_add(&first, 20);
+	run_all();
+	CHECK(first_count == 1);
+	CHECK(second_count == 0);
+	CHECK(!wheel_is_armed(&second));
+
+	wheel_add(&again, 0);
+	run_all();
+	CHECK(again_count == 3);
+
+	/* a timer of more than one round */
+	wheel_add(&second, 256 * 10 + 20);
+	run_all();
+	CHECK(second_count == 1);
+
+	printf("test-wheel: %s\n", failures ? "FAILED" : "ok");
+	return !!failures;
+}
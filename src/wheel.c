@@ -0,0 +1,141 @@
+/* 2014, Copyright Intel & Jose Bollo <jose.bollo@open.eurogiciel.org>, license MIT */
+
+#include <time.h>
+#include <assert.h>
+
+#include "wheel.h"
+
+#define WHEEL_SIZE	256 /* count of slots, MUST be a power of 2 */
+#define RUNNING_SLOT	WHEEL_SIZE /* the timers of the slot being run */
+
+#define SLOT(tick)	(assert(!(WHEEL_SIZE & (WHEEL_SIZE - 1))), ((int)(tick) & (WHEEL_SIZE - 1)))
+
+static struct wheel_timer *slots[WHEEL_SIZE + 1];
+static unsigned long current_tick = 0;
+static int tick_ms = 100;
+static int timer_count = 0;
+
+/* get the monotonic time in ms */
+static unsigned long now_ms()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long)ts.tv_sec * 1000 + (unsigned long)ts.tv_nsec / 1000000;
+}
+
+void wheel_init(int tickms)
+{
+	assert(tickms > 0);
+
+	tick_ms = tickms;
+	current_tick = now_ms() / tick_ms;
+}
+
+void wheel_timer_init(struct wheel_timer *timer, void (*cb)(void *data), void *data)
+{
+	assert(timer);
+	assert(cb);
+
+	timer->next = timer->prev = 0;
+	timer->cb = cb;
+	timer->data = data;
+	timer->rounds = 0;
+	timer->slot = -1;
+}
+
+/* link the timer at head of the slot */
+static void link_timer(struct wheel_timer *timer, int slot)
+{
+	timer->prev = 0;
+	timer->next = slots[slot];
+	if (timer->next)
+		timer->next->prev = timer;
+	slots[slot] = timer;
+	timer->slot = slot;
+	timer_count++;
+}
+
+void wheel_add(struct wheel_timer *timer, int delayms)
+{
+	int ticks;
+
+	assert(timer);
+	assert(timer->cb);
+	assert(timer->slot < 0);
+	assert(delayms >= 0);
+
+	/* compute the slot and the count of turns */
+	ticks = (delayms + tick_ms - 1) / tick_ms;
+	if (!ticks)
+		ticks = 1;
+	timer->rounds = (ticks - 1) / WHEEL_SIZE;
+	link_timer(timer, SLOT(current_tick + ticks));
+}
+
+void wheel_remove(struct wheel_timer *timer)
+{
+	assert(timer);
+	assert(timer->slot >= 0);
+
+	if (timer->prev)
+		timer->prev->next = timer->next;
+	else
+		slots[timer->slot] = timer->next;
+	if (timer->next)
+		timer->next->prev = timer->prev;
+	timer->next = timer->prev = 0;
+	timer->slot = -1;
+	timer_count--;
+}
+
+int wheel_is_armed(struct wheel_timer *timer)
+{
+	return timer->slot >= 0;
+}
+
+/* the delay in ms before the next tick or -1 if no timer is armed */
+int wheel_timeout()
+{
+	unsigned long now, next;
+
+	if (!timer_count)
+		return -1;
+
+	now = now_ms();
+	next = (current_tick + 1) * tick_ms;
+	return next > now ? (int)(next - now) : 0;
+}
+
+/*
+call the callbacks of the expired timers. the timers of the slot are
+taken one at a time, so a callback removing a timer of the same tick
+cancels it.
+*/
+void wheel_run()
+{
+	unsigned long tick;
+	struct wheel_timer *timer;
+	int slot;
+
+	tick = now_ms() / tick_ms;
+	while (current_tick < tick) {
+		current_tick++;
+		slot = SLOT(current_tick);
+
+		/* the timers of the slot are moved aside to be run */
+		slots[RUNNING_SLOT] = slots[slot];
+		slots[slot] = 0;
+		for (timer = slots[RUNNING_SLOT] ; timer ; timer = timer->next)
+			timer->slot = RUNNING_SLOT;
+
+		while ((timer = slots[RUNNING_SLOT])) {
+			wheel_remove(timer);
+			if (timer->rounds) {
+				timer->rounds--;
+				link_timer(timer, slot);
+			} else
+				timer->cb(timer->data);
+		}
+	}
+}
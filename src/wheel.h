@@ -0,0 +1,18 @@
+/* 2014, Copyright Intel & Jose Bollo <jose.bollo@open.eurogiciel.org>, license MIT */
+
+struct wheel_timer {
+	struct wheel_timer *next;
+	struct wheel_timer *prev;
+	void (*cb)(void *data);
+	void *data;
+	int rounds;
+	int slot;
+};
+
+void wheel_init(int tickms);
+void wheel_timer_init(struct wheel_timer *timer, void (*cb)(void *data), void *data);
+void wheel_add(struct wheel_timer *timer, int delayms);
+void wheel_remove(struct wheel_timer *timer);
+int wheel_is_armed(struct wheel_timer *timer);
+int wheel_timeout();
+void wheel_run();